@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "adaptive_limit.hpp"
+
+#include <algorithm>
+
+
+namespace nabtocli {
+
+static const double BACKOFF = 0.5;
+static const int64_t TOLERANCE = 2;
+
+AdaptiveLimit::AdaptiveLimit(double initial, double min, double max)
+    : limit_(std::min(std::max(initial, min), max)), min_(min), max_(max) {
+}
+
+bool AdaptiveLimit::sample(Clock::time_point start, Clock::time_point end, bool ok, size_t inFlight) {
+    size_t before = limit();
+    int64_t latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    if (ok && (baselineUs_ == 0 || latencyUs < baselineUs_)) {
+        baselineUs_ = std::max<int64_t>(latencyUs, 1);
+    }
+    bool overloaded = !ok || latencyUs > TOLERANCE * baselineUs_;
+    if (overloaded) {
+        if (start >= lastDecrease_) {
+            limit_ = std::max(min_, limit_ * BACKOFF);
+            lastDecrease_ = end;
+            decreases_++;
+        }
+    } else if (inFlight + 1 >= before) {
+        // only grow a limit that is actually used
+        limit_ = std::min(max_, limit_ + 1.0 / limit_);
+    }
+    return limit() != before;
+}
+
+} // namespace
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+
+namespace nabtocli {
+
+/**
+ * AIMD concurrency limit for one device. The lowest latency seen is
+ * taken as the baseline. Each successful completion while the limit is
+ * in use adds 1/limit, i.e. about one permit per round trip. An error,
+ * or a latency above twice the baseline, halves the limit, at most once
+ * per round trip: samples of requests started before the last decrease
+ * do not decrease it again. Not thread safe.
+ */
+class AdaptiveLimit {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    AdaptiveLimit(double initial, double min, double max);
+    // returns true if the integer limit changed
+    bool sample(Clock::time_point start, Clock::time_point end, bool ok, size_t inFlight);
+    size_t limit() const { return (size_t)limit_; }
+    int64_t baselineUs() const { return baselineUs_; }
+    uint64_t decreases() const { return decreases_; }
+
+private:
+    double limit_;
+    double min_;
+    double max_;
+    int64_t baselineUs_ = 0;
+    Clock::time_point lastDecrease_;
+    uint64_t decreases_ = 0;
+};
+
+} // namespace
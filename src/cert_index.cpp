@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "cert_index.hpp"
+#include "hex.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+namespace nabtocli {
+
+static const char* INDEX_FILE = "nabto-cli-cert-index";
+
+CertIndex::CertIndex(const std::string& homeDir, Fingerprinter fingerprinter)
+    : homeDir_(homeDir), fingerprinter_(fingerprinter) {
+}
+
+bool CertIndex::profileStat(const std::string& name, Entry& entry) {
+    if (homeDir_.empty()) {
+        return false;
+    }
+    std::string file = homeDir_ + "/users/" + name + ".crt";
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0) {
+        return false;
+    }
+    // a profile recreated within the same second must not keep its old fingerprint
+#if defined(__APPLE__)
+    long nsec = st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    long nsec = st.st_mtim.tv_nsec;
+#else
+    long nsec = 0;
+#endif
+    entry.mtimeNs = (int64_t)st.st_mtime * 1000000000 + nsec;
+    entry.size = (int64_t)st.st_size;
+    return true;
+}
+
+void CertIndex::load() {
+    if (homeDir_.empty()) {
+        return;
+    }
+    std::ifstream ifs((homeDir_ + "/" + INDEX_FILE).c_str());
+    std::string line;
+    while (std::getline(ifs, line)) {
+        // <mtime ns> <size> <fingerprint> <name>, name last as it may contain spaces
+        std::istringstream ls(line);
+        Entry entry;
+        std::string name;
+        if (!(ls >> entry.mtimeNs >> entry.size >> entry.fingerprint)) {
+            continue;
+        }
+        ls.get();
+        std::getline(ls, name);
+        if (!name.empty()) {
+            entries_[name] = entry;
+        }
+    }
+}
+
+bool CertIndex::save() {
+    if (homeDir_.empty() || !dirty_) {
+        return true;
+    }
+    std::string file = homeDir_ + "/" + INDEX_FILE;
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream ofs(tmp.c_str(), std::ofstream::out | std::ofstream::trunc);
+        for (auto&& e : entries_) {
+            ofs << e.second.mtimeNs << " " << e.second.size << " " << e.second.fingerprint << " " << e.first << "\n";
+        }
+        if (!ofs.good()) {
+            return false;
+        }
+    }
+    // rename does not replace an existing file on windows
+    std::remove(file.c_str());
+    if (std::rename(tmp.c_str(), file.c_str()) != 0) {
+        return false;
+    }
+    dirty_ = false;
+    return true;
+}
+
+bool CertIndex::fingerprint(const std::string& name, std::string& fingerprint) {
+    Entry current;
+    bool exists = profileStat(name, current);
+    auto it = entries_.find(name);
+    if (exists && it != entries_.end() && it->second.mtimeNs == current.mtimeNs && it->second.size == current.size) {
+        fingerprint = it->second.fingerprint;
+        return true;
+    }
+    if (!fingerprinter_(name, fingerprint)) {
+        return false;
+    }
+    if (exists) {
+        current.fingerprint = fingerprint;
+        entries_[name] = current;
+        dirty_ = true;
+    }
+    return true;
+}
+
+void CertIndex::retain(const std::set<std::string>& names) {
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        if (names.count(it->first) == 0) {
+            it = entries_.erase(it);
+            dirty_ = true;
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::string normalizeFingerprint(const std::string& fingerprint) {
+    std::vector<char> bytes;
+    std::string error;
+    if (!Hex::decode(fingerprint, bytes, error)) {
+        return fingerprint;
+    }
+    return Hex::encode((const unsigned char*)bytes.data(), bytes.size(), ':');
+}
+
+} // namespace
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <cstdint>
+#include <functional>
+
+
+namespace nabtocli {
+
+/**
+ * Persisted index of certificate name to fingerprint in the Nabto home
+ * dir. A fingerprint is only recomputed if the profile file changed
+ * since it was indexed, judged by its modification time (to the
+ * nanosecond where the platform has it) and size.
+ */
+class CertIndex {
+public:
+    typedef std::function<bool(const std::string& name, std::string& fingerprint)> Fingerprinter;
+    CertIndex(const std::string& homeDir, Fingerprinter fingerprinter);
+    void load();
+    bool save();
+    bool fingerprint(const std::string& name, std::string& fingerprint);
+    // forget certificates not in names
+    void retain(const std::set<std::string>& names);
+private:
+    struct Entry {
+        int64_t mtimeNs;
+        int64_t size;
+        std::string fingerprint;
+    };
+    // false if the profile does not exist
+    bool profileStat(const std::string& name, Entry& entry);
+    std::string homeDir_;
+    Fingerprinter fingerprinter_;
+    std::map<std::string, Entry> entries_;
+    bool dirty_ = false;
+};
+
+// lowercase colon separated form of a fingerprint given with or without colons
+std::string normalizeFingerprint(const std::string& fingerprint);
+
+} // namespace
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "change_filter.hpp"
+
+#include <cstring>
+
+
+namespace nabtocli {
+
+static const uint64_t PRIME1 = 0x9e3779b185ebca87ULL;
+static const uint64_t PRIME2 = 0xc2b2ae3d27d4eb4fULL;
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// murmur3 finalizer, spreads every input bit over the whole word
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Eight bytes per multiply, which hashes typical RPC responses of a few
+ * hundred bytes in tens of nanoseconds.
+ */
+uint64_t hashBytes(const char* data, size_t length, uint64_t seed) {
+    uint64_t h = seed ^ (length * PRIME1);
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        h = rotl(h ^ (word * PRIME2), 31) * PRIME1;
+        data += 8;
+        length -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data, length);
+    h = rotl(h ^ (tail * PRIME2), 31) * PRIME1;
+    return mix(h);
+}
+
+ChangeFilter::ChangeFilter(std::chrono::seconds heartbeat)
+    : heartbeat_(heartbeat) {
+}
+
+bool ChangeFilter::update(const std::string& url, nabto_status_t status, const std::string& body) {
+    uint64_t hash = hashBytes(body.data(), body.size(), (uint64_t)status);
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = last_.find(url);
+    if (it == last_.end()) {
+        Entry& entry = last_[url];
+        entry.hash = hash;
+        entry.emitted = now;
+        return true;
+    }
+    Entry& entry = it->second;
+    if (entry.hash == hash && (heartbeat_.count() == 0 || now - entry.emitted < heartbeat_)) {
+        return false;
+    }
+    entry.hash = hash;
+    entry.emitted = now;
+    return true;
+}
+
+} // namespace
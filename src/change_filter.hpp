@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "nabto_client_api.h"
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+
+
+namespace nabtocli {
+
+/**
+ * Decides which results of repeated invocations are worth emitting: a
+ * result is passed on if it differs from the previous result for the
+ * same URL, or as a heartbeat if nothing has been passed on for the
+ * heartbeat interval (0 for no heartbeats). Results are compared by a
+ * 64 bit hash of status and body only.
+ */
+class ChangeFilter {
+public:
+    ChangeFilter(std::chrono::seconds heartbeat);
+    // true if the result should be emitted
+    bool update(const std::string& url, nabto_status_t status, const std::string& body);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Entry {
+        uint64_t hash;
+        Clock::time_point emitted;
+    };
+
+    std::chrono::seconds heartbeat_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> last_;
+};
+
+// fast non-cryptographic hash, not stable across versions
+uint64_t hashBytes(const char* data, size_t length, uint64_t seed = 0);
+
+} // namespace
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "circuit_breaker.hpp"
+#include "output.hpp"
+#include "log.hpp"
+
+#include <cstring>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace nabtocli {
+
+static const char MAGIC[8] = { 'N', 'C', 'L', 'I', 'B', 'R', 'K', '1' };
+static const uint32_t SLOT_COUNT = 512;
+static const size_t DEVICE_SIZE = 112;
+
+struct Header {
+    char magic[8];
+    uint32_t slots;
+    uint32_t reserved;
+};
+
+// an empty device name marks a free slot
+struct CircuitBreaker::Slot {
+    char device[DEVICE_SIZE];
+    int32_t state;
+    uint32_t failures;
+    int64_t since; // unix time in ms of the last failure or state change
+};
+
+static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+CircuitBreaker::CircuitBreaker(int threshold, std::chrono::seconds probeInterval)
+    : threshold_(threshold < 1 ? 1 : threshold), probeInterval_(probeInterval) {
+}
+
+const char* CircuitBreaker::stateName(State state) {
+    switch (state) {
+    case STATE_CLOSED: return "closed";
+    case STATE_OPEN: return "open";
+    case STATE_HALF_OPEN: return "half-open";
+    default: return "?";
+    }
+}
+
+void CircuitBreaker::changed(const std::string& device, State state, uint32_t failures) {
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("circuit_breaker");
+        event["device"] = device;
+        event["state"] = stateName(state);
+        event["failures"] = failures;
+        Output::emit(event);
+    }
+    if (state == STATE_OPEN) {
+        CLI_LOG_WARN("Circuit breaker for " << device << " opened after " << failures << " failures");
+    } else {
+        CLI_LOG_INFO("Circuit breaker for " << device << " is " << stateName(state));
+    }
+}
+
+#ifndef WIN32
+
+/**
+ * Exclusive lock of the state file for the duration of an update.
+ */
+class FileLock {
+public:
+    FileLock(int fd) : fd_(fd) { flock(fd_, LOCK_EX); }
+    ~FileLock() { flock(fd_, LOCK_UN); }
+private:
+    int fd_;
+};
+
+CircuitBreaker::~CircuitBreaker() {
+    if (map_) {
+        munmap(map_, size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+bool CircuitBreaker::open(const std::string& file) {
+    fd_ = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) {
+        return false;
+    }
+    size_ = sizeof(Header) + SLOT_COUNT * sizeof(Slot);
+    FileLock lock(fd_);
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        return false;
+    }
+    Header header;
+    bool valid = (size_t)st.st_size == size_ &&
+        pread(fd_, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.slots == SLOT_COUNT;
+    if (!valid) {
+        // new file, or a layout we do not know: start over with all breakers closed
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.slots = SLOT_COUNT;
+        if (ftruncate(fd_, 0) != 0 || ftruncate(fd_, size_) != 0 ||
+            pwrite(fd_, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            return false;
+        }
+    }
+    void* map = mmap(0, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    map_ = map;
+    slots_ = reinterpret_cast<Slot*>(static_cast<char*>(map_) + sizeof(Header));
+    return true;
+}
+
+/**
+ * Slot of a device, called with the file locked. When creating and the
+ * table is full, the slot with the oldest activity is reused. Names that
+ * do not fit a slot get no breaker, as a truncated name could be shared
+ * with another device.
+ */
+CircuitBreaker::Slot* CircuitBreaker::find(const std::string& device, bool create) {
+    if (device.empty() || device.size() >= DEVICE_SIZE) {
+        return 0;
+    }
+    Slot* free = 0;
+    Slot* oldest = 0;
+    for (uint32_t i = 0; i < SLOT_COUNT; i++) {
+        Slot* s = &slots_[i];
+        if (!s->device[0]) {
+            if (!free) {
+                free = s;
+            }
+        } else if (strncmp(s->device, device.c_str(), DEVICE_SIZE) == 0) {
+            return s;
+        } else if (!oldest || s->since < oldest->since) {
+            oldest = s;
+        }
+    }
+    if (!create) {
+        return 0;
+    }
+    Slot* s = free ? free : oldest;
+    memset(s, 0, sizeof(Slot));
+    memcpy(s->device, device.c_str(), device.size() + 1);
+    s->state = STATE_CLOSED;
+    return s;
+}
+
+bool CircuitBreaker::allow(const std::string& device) {
+    if (!slots_) {
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(mutex_);
+    FileLock lock(fd_);
+    Slot* s = find(device, false);
+    if (!s || s->state == STATE_CLOSED) {
+        return true;
+    }
+    int64_t now = nowMs();
+    if (now - s->since < std::chrono::duration_cast<std::chrono::milliseconds>(probeInterval_).count()) {
+        // open, or half-open with a probe in flight
+        return false;
+    }
+    // this caller is the probe; a half-open probe this old was lost, e.g. its process was killed
+    bool wasOpen = s->state == STATE_OPEN;
+    s->state = STATE_HALF_OPEN;
+    s->since = now;
+    if (wasOpen) {
+        changed(device, STATE_HALF_OPEN, s->failures);
+    }
+    return true;
+}
+
+void CircuitBreaker::record(const std::string& device, bool ok) {
+    if (!slots_) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(mutex_);
+    FileLock lock(fd_);
+    if (ok) {
+        Slot* s = find(device, false);
+        if (s) {
+            State previous = (State)s->state;
+            memset(s, 0, sizeof(Slot));
+            if (previous != STATE_CLOSED) {
+                changed(device, STATE_CLOSED, 0);
+            }
+        }
+        return;
+    }
+    Slot* s = find(device, true);
+    if (!s) {
+        return;
+    }
+    s->failures++;
+    if (s->state == STATE_HALF_OPEN || (s->state == STATE_CLOSED && s->failures >= (uint32_t)threshold_)) {
+        s->state = STATE_OPEN;
+        s->since = nowMs();
+        changed(device, STATE_OPEN, s->failures);
+    } else if (s->state == STATE_CLOSED) {
+        s->since = nowMs();
+    }
+}
+
+CircuitBreaker::State CircuitBreaker::state(const std::string& device) {
+    if (!slots_) {
+        return STATE_CLOSED;
+    }
+    std::lock_guard<std::mutex> guard(mutex_);
+    FileLock lock(fd_);
+    Slot* s = find(device, false);
+    return s ? (State)s->state : STATE_CLOSED;
+}
+
+#else
+
+CircuitBreaker::~CircuitBreaker() {
+}
+
+bool CircuitBreaker::open(const std::string& file) {
+    return false;
+}
+
+bool CircuitBreaker::allow(const std::string& device) {
+    return true;
+}
+
+void CircuitBreaker::record(const std::string& device, bool ok) {
+}
+
+CircuitBreaker::State CircuitBreaker::state(const std::string& device) {
+    return STATE_CLOSED;
+}
+
+#endif
+
+} // namespace
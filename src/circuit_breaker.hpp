@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+
+namespace nabtocli {
+
+/**
+ * Per device circuit breaker shared by all nabto-cli processes through
+ * a small memory mapped file. After threshold consecutive failures to
+ * reach a device its breaker opens and calls fail fast. Once the probe
+ * interval has passed, one caller is let through as a probe
+ * (half-open): success closes the breaker, failure opens it again.
+ * Only devices with failures occupy a slot in the file.
+ */
+class CircuitBreaker {
+public:
+    enum State {
+        STATE_CLOSED,
+        STATE_OPEN,
+        STATE_HALF_OPEN
+    };
+
+    CircuitBreaker(int threshold, std::chrono::seconds probeInterval);
+    ~CircuitBreaker();
+    // map the state file, creating it if needed; not supported on Windows
+    bool open(const std::string& file);
+    // false if calls to the device should fail fast
+    bool allow(const std::string& device);
+    // outcome of a call that reached, or failed to reach, the device
+    void record(const std::string& device, bool ok);
+    State state(const std::string& device);
+    static const char* stateName(State state);
+
+private:
+    struct Slot;
+    Slot* find(const std::string& device, bool create);
+    void changed(const std::string& device, State state, uint32_t failures);
+
+    int threshold_;
+    std::chrono::seconds probeInterval_;
+    // flock only excludes other processes
+    std::mutex mutex_;
+    int fd_ = -1;
+    Slot* slots_ = 0;
+    void* map_ = 0;
+    size_t size_ = 0;
+};
+
+} // namespace
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "device_scheduler.hpp"
+#include "output.hpp"
+#include "log.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+
+namespace nabtocli {
+
+DeviceScheduler::DeviceScheduler(size_t workers, size_t perDevice)
+    : workers_(workers == 0 ? 1 : workers), perDevice_(perDevice), pool_(workers_) {
+}
+
+void DeviceScheduler::setAdaptive(size_t initial, size_t max) {
+    adaptive_ = true;
+    adaptiveMax_ = max == 0 ? 1 : max;
+    adaptiveInitial_ = initial == 0 ? 1 : initial;
+}
+
+size_t DeviceScheduler::cap(const DeviceQueue& queue) const {
+    return queue.limit ? queue.limit->limit() : perDevice_;
+}
+
+bool DeviceScheduler::runnable(const DeviceQueue& queue) const {
+    size_t limit = cap(queue);
+    return !queue.tasks.empty() && (limit == 0 || queue.running < limit);
+}
+
+void DeviceScheduler::markReady(const std::string& device, DeviceQueue& queue) {
+    if (!queue.ready && runnable(queue)) {
+        queue.ready = true;
+        ready_.push_back(device);
+    }
+}
+
+void DeviceScheduler::submit(const std::string& device, Task task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    DeviceQueue& queue = devices_[device];
+    if (adaptive_ && !queue.limit) {
+        queue.limit.reset(new AdaptiveLimit(adaptiveInitial_, 1, adaptiveMax_));
+        queue.maxLimit = queue.limit->limit();
+    }
+    Queued queued;
+    queued.task = std::move(task);
+    queued.enqueued = Clock::now();
+    queue.tasks.push_back(std::move(queued));
+    if (queue.tasks.size() > queue.maxDepth) {
+        queue.maxDepth = queue.tasks.size();
+    }
+    markReady(device, queue);
+    dispatch();
+}
+
+/**
+ * Hand tasks to idle workers, one per ready device in turn. Never more
+ * tasks than workers are posted, so the order is decided here and not
+ * by the pool's FIFO. Called with mutex_ held.
+ */
+void DeviceScheduler::dispatch() {
+    while (running_ < workers_ && !ready_.empty()) {
+        std::string device = ready_.front();
+        ready_.pop_front();
+        DeviceQueue& queue = devices_[device];
+        queue.ready = false;
+        if (!runnable(queue)) {
+            continue;
+        }
+        Queued queued = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        queue.running++;
+        running_++;
+        queue.wait.record(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - queued.enqueued).count());
+        markReady(device, queue);
+        // shared so the pool's std::function stays copyable
+        std::shared_ptr<Queued> q = std::make_shared<Queued>(std::move(queued));
+        pool_.post([this, device, q]() { run(device, std::move(*q)); });
+    }
+}
+
+void DeviceScheduler::run(const std::string& device, Queued queued) {
+    Clock::time_point start = Clock::now();
+    Outcome outcome = queued.task();
+    Clock::time_point end = Clock::now();
+    bool ok = outcome == SUCCEEDED;
+    std::lock_guard<std::mutex> lock(mutex_);
+    DeviceQueue& queue = devices_[device];
+    // local failures say nothing about the device's latency or load
+    if (queue.limit && outcome != NOT_SENT && queue.limit->sample(start, end, ok, queue.running - 1)) {
+        queue.maxLimit = std::max(queue.maxLimit, queue.limit->limit());
+        limitChanged(device, queue, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), ok);
+    }
+    queue.running--;
+    running_--;
+    markReady(device, queue);
+    dispatch();
+}
+
+void DeviceScheduler::limitChanged(const std::string& device, const DeviceQueue& queue, int64_t latencyUs, bool ok) {
+    const AdaptiveLimit& limit = *queue.limit;
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("rpc_limit");
+        event["device"] = device;
+        event["limit"] = (Json::UInt64)limit.limit();
+        event["latency_us"] = (Json::Int64)latencyUs;
+        event["baseline_us"] = (Json::Int64)limit.baselineUs();
+        event["ok"] = ok;
+        Output::emit(event);
+    }
+    CLI_LOG_DEBUG("RPC limit of " << device << " is now " << limit.limit() << " (latency " << latencyUs / 1000.0
+                  << " ms, baseline " << limit.baselineUs() / 1000.0 << " ms" << (ok ? "" : ", failed") << ")");
+}
+
+void DeviceScheduler::wait() {
+    pool_.wait();
+}
+
+void DeviceScheduler::printStats() {
+    // limit changes are logged asynchronously, keep them before the summary
+    Log::flush();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& d : devices_) {
+        const DeviceQueue& queue = d.second;
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("rpc_device_stats");
+            event["device"] = d.first;
+            event["max_queue_depth"] = (Json::UInt64)queue.maxDepth;
+            event["wait"] = queue.wait.toJson("us");
+            if (queue.limit) {
+                event["limit"] = (Json::UInt64)queue.limit->limit();
+                event["max_limit"] = (Json::UInt64)queue.maxLimit;
+                event["limit_decreases"] = (Json::UInt64)queue.limit->decreases();
+                event["baseline_us"] = (Json::Int64)queue.limit->baselineUs();
+            }
+            Output::emit(event);
+            continue;
+        }
+        std::ostream& out = Output::results();
+        out << std::fixed << std::setprecision(2)
+            << "Device " << d.first << ": " << queue.wait.count() << " requests, max queue depth " << queue.maxDepth
+            << ", queue wait p50 " << queue.wait.percentile(50) / 1000.0
+            << " ms, p99 " << queue.wait.percentile(99) / 1000.0
+            << " ms, max " << queue.wait.max() / 1000.0 << " ms";
+        if (queue.limit) {
+            out << ", limit " << queue.limit->limit() << " (max " << queue.maxLimit << ", "
+                << queue.limit->decreases() << " decreases, baseline "
+                << queue.limit->baselineUs() / 1000.0 << " ms)";
+        }
+        out << std::endl << std::defaultfloat << std::setprecision(6);
+    }
+}
+
+} // namespace
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "worker_pool.hpp"
+#include "histogram.hpp"
+#include "adaptive_limit.hpp"
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <functional>
+
+
+namespace nabtocli {
+
+/**
+ * Runs tasks on a shared worker pool with a FIFO queue per device. At
+ * most perDevice tasks of a device run at once (0 for no limit), as
+ * devices serialise requests anyway. Free workers take the next task
+ * from the device queues in round robin order, so a device with a long
+ * queue or slow responses cannot starve the others.
+ *
+ * In adaptive mode the cap of each device is instead an AdaptiveLimit
+ * driven by the latency and outcome of its tasks.
+ */
+class DeviceScheduler {
+public:
+    enum Outcome {
+        SUCCEEDED,
+        // failures that indicate an overloaded device
+        FAILED,
+        // failed locally without reaching the device, e.g. an open circuit breaker
+        NOT_SENT
+    };
+    typedef std::function<Outcome()> Task;
+
+    DeviceScheduler(size_t workers, size_t perDevice);
+    // adapt per device caps between 1 and max, starting at initial; call before submit
+    void setAdaptive(size_t initial, size_t max);
+    void submit(const std::string& device, Task task);
+    // block until all submitted tasks have run
+    void wait();
+    // queue depth and wait time per device
+    void printStats();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Queued {
+        Task task;
+        Clock::time_point enqueued;
+    };
+    struct DeviceQueue {
+        std::deque<Queued> tasks;
+        size_t running = 0;
+        bool ready = false;
+        size_t maxDepth = 0;
+        Histogram wait;
+        std::unique_ptr<AdaptiveLimit> limit;
+        size_t maxLimit = 0;
+    };
+
+    size_t cap(const DeviceQueue& queue) const;
+    bool runnable(const DeviceQueue& queue) const;
+    void markReady(const std::string& device, DeviceQueue& queue);
+    void dispatch();
+    void run(const std::string& device, Queued queued);
+    void limitChanged(const std::string& device, const DeviceQueue& queue, int64_t latencyUs, bool ok);
+
+    size_t workers_;
+    size_t perDevice_;
+    bool adaptive_ = false;
+    size_t adaptiveInitial_ = 0;
+    size_t adaptiveMax_ = 0;
+    std::mutex mutex_;
+    std::map<std::string, DeviceQueue> devices_;
+    // devices with a runnable task, in round robin order
+    std::deque<std::string> ready_;
+    size_t running_ = 0;
+    // declared last so workers are joined before the state above is destroyed
+    WorkerPool pool_;
+};
+
+} // namespace
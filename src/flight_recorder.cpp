@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "flight_recorder.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#ifndef WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+
+namespace nabtocli {
+
+static const size_t RING_SIZE = 4096;
+static const size_t TEXT_SIZE = 112;
+static const size_t MAX_PATH_SIZE = 1024;
+
+/**
+ * seq is odd while a slot is being written and 2*(n+1) once it holds
+ * event number n, so a dump can skip slots torn by a concurrent write.
+ * Writers claim a slot with a CAS on seq, so two writers that wrap onto
+ * the same slot never write it at the same time.
+ */
+struct Slot {
+    std::atomic<uint64_t> seq;
+    int64_t timestamp; // unix time in us
+    int64_t code;
+    int64_t value;
+    int32_t event;
+    char text[TEXT_SIZE];
+};
+
+// static storage, zero initialized before any code runs
+static Slot slots_[RING_SIZE];
+static std::atomic<uint64_t> next_ { 0 };
+static char path_[MAX_PATH_SIZE];
+static std::string file_;
+
+static const char* eventName(int32_t event) {
+    switch (event) {
+    case FlightRecorder::EVENT_TUNNEL_STATE: return "tunnel_state";
+    case FlightRecorder::EVENT_TUNNEL_CLOSED: return "tunnel_closed";
+    case FlightRecorder::EVENT_RPC: return "rpc";
+    case FlightRecorder::EVENT_STREAM_OPEN: return "stream_open";
+    case FlightRecorder::EVENT_STREAM_CLOSED: return "stream_closed";
+    case FlightRecorder::EVENT_ERROR: return "error";
+    default: return "?";
+    }
+}
+
+static size_t copyText(char* dst, size_t pos, const char* src) {
+    while (*src && pos < TEXT_SIZE - 1) {
+        dst[pos++] = *src++;
+    }
+    return pos;
+}
+
+void FlightRecorder::record(Event event, int64_t code, int64_t value, const char* subject, const char* detail) {
+    uint64_t n = next_.fetch_add(1, std::memory_order_relaxed);
+    Slot& s = slots_[n & (RING_SIZE - 1)];
+    uint64_t seq = s.seq.load(std::memory_order_relaxed);
+    do {
+        if ((seq & 1) || seq > 2 * n) {
+            // still being written by an older event, or already reused by
+            // a newer one: drop this event rather than wait
+            return;
+        }
+    } while (!s.seq.compare_exchange_weak(seq, 2 * n + 1, std::memory_order_acquire, std::memory_order_relaxed));
+    std::atomic_thread_fence(std::memory_order_release);
+    s.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    s.code = code;
+    s.value = value;
+    s.event = event;
+    size_t pos = copyText(s.text, 0, subject ? subject : "");
+    if (detail) {
+        pos = copyText(s.text, pos, " ");
+        pos = copyText(s.text, pos, detail);
+    }
+    s.text[pos] = 0;
+    s.seq.store(2 * n + 2, std::memory_order_release);
+}
+
+const std::string& FlightRecorder::file() {
+    return file_;
+}
+
+#ifndef WIN32
+
+/**
+ * Line formatting without locale, allocation or stdio, all of which
+ * are unsafe in signal handlers.
+ */
+class LineWriter {
+public:
+    LineWriter() : len_(0) {}
+    void str(const char* s) {
+        while (*s && len_ < sizeof(buf_)) {
+            buf_[len_++] = *s++;
+        }
+    }
+    void num(int64_t v, int width = 0) {
+        char digits[24];
+        int n = 0;
+        bool negative = v < 0;
+        uint64_t u = negative ? 0 - (uint64_t)v : (uint64_t)v;
+        do {
+            digits[n++] = (char)('0' + u % 10);
+            u /= 10;
+        } while (u > 0);
+        while (n < width) {
+            digits[n++] = '0';
+        }
+        if (negative) {
+            str("-");
+        }
+        while (n > 0 && len_ < sizeof(buf_)) {
+            buf_[len_++] = digits[--n];
+        }
+    }
+    bool flush(int fd) {
+        const char* p = buf_;
+        size_t left = len_;
+        len_ = 0;
+        while (left > 0) {
+            ssize_t w = write(fd, p, left);
+            if (w <= 0) {
+                return false;
+            }
+            p += w;
+            left -= w;
+        }
+        return true;
+    }
+private:
+    char buf_[256];
+    size_t len_;
+};
+
+static void fatalHandler(int signo) {
+    static std::atomic<bool> dumping { false };
+    if (!dumping.exchange(true)) {
+        FlightRecorder::record(FlightRecorder::EVENT_ERROR, signo, 0, "fatal signal");
+        if (FlightRecorder::dump()) {
+            LineWriter line;
+            line.str("Fatal signal ");
+            line.num(signo);
+            line.str(", flight recorder dumped to ");
+            line.str(path_);
+            line.str("\n");
+            line.flush(STDERR_FILENO);
+        }
+    }
+    // SA_RESETHAND restored the default action
+    raise(signo);
+}
+
+bool FlightRecorder::install(const std::string& file) {
+    if (file.size() >= MAX_PATH_SIZE) {
+        return false;
+    }
+    memcpy(path_, file.c_str(), file.size() + 1);
+    file_ = file;
+
+    // lets the handler run after a stack overflow, but only on the calling
+    // thread: other threads have no alternate stack, so an overflow there
+    // kills the process without a dump
+    static char altStack[64 * 1024];
+    stack_t ss;
+    ss.ss_sp = altStack;
+    ss.ss_size = sizeof(altStack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, 0);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fatalHandler;
+    sa.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    for (int signo : signals) {
+        sigaction(signo, &sa, 0);
+    }
+    return true;
+}
+
+bool FlightRecorder::dump() {
+    if (!path_[0]) {
+        return false;
+    }
+    int fd = open(path_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    uint64_t end = next_.load(std::memory_order_acquire);
+    uint64_t start = end > RING_SIZE ? end - RING_SIZE : 0;
+    LineWriter line;
+    line.str("# nabto-cli flight recorder: seq unix_time event code value text\n");
+    bool ok = line.flush(fd);
+    for (uint64_t n = start; n < end && ok; n++) {
+        const Slot& s = slots_[n & (RING_SIZE - 1)];
+        uint64_t seq = s.seq.load(std::memory_order_acquire);
+        if (seq != 2 * n + 2) {
+            // being written, or already overwritten by a newer event
+            continue;
+        }
+        int64_t timestamp = s.timestamp;
+        int64_t code = s.code;
+        int64_t value = s.value;
+        int32_t event = s.event;
+        char text[TEXT_SIZE];
+        memcpy(text, s.text, TEXT_SIZE);
+        text[TEXT_SIZE - 1] = 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.seq.load(std::memory_order_relaxed) != seq) {
+            continue;
+        }
+        line.num(n);
+        line.str(" ");
+        line.num(timestamp / 1000000);
+        line.str(".");
+        line.num(timestamp % 1000000, 6);
+        line.str(" ");
+        line.str(eventName(event));
+        line.str(" code=");
+        line.num(code);
+        line.str(" value=");
+        line.num(value);
+        line.str(" ");
+        line.str(text);
+        line.str("\n");
+        ok = line.flush(fd);
+    }
+    close(fd);
+    return ok;
+}
+
+#else
+
+bool FlightRecorder::install(const std::string& file) {
+    file_ = file;
+    return false;
+}
+
+bool FlightRecorder::dump() {
+    return false;
+}
+
+#endif
+
+} // namespace
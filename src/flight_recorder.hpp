@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+
+namespace nabtocli {
+
+/**
+ * Always-on record of the most recent events (tunnel state changes, RPC
+ * results, stream open/close, errors) in a fixed size lock-free ring.
+ * Recording is a few hundred nanoseconds and never allocates. The ring
+ * can be dumped from a signal handler, e.g. on SIGUSR2 or on a crash.
+ */
+class FlightRecorder {
+public:
+    enum Event {
+        EVENT_TUNNEL_STATE,
+        EVENT_TUNNEL_CLOSED,
+        EVENT_RPC,
+        EVENT_STREAM_OPEN,
+        EVENT_STREAM_CLOSED,
+        EVENT_ERROR
+    };
+    // subject and detail are truncated to fit a fixed size slot
+    static void record(Event event, int64_t code, int64_t value, const char* subject, const char* detail = 0);
+    // dump to file on fatal signals, the file name is fixed here; stack
+    // overflows are only covered on the calling thread, i.e. call from main
+    static bool install(const std::string& file);
+    // write the ring to the installed file, oldest event first, async signal safe
+    static bool dump();
+    static const std::string& file();
+};
+
+} // namespace
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "hex.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NABTO_CLI_HEX_SSE2 1
+#endif
+
+
+namespace nabtocli {
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// nibble value of a hex digit, 0xff for anything else
+struct DecodeTable {
+    unsigned char value[256];
+    DecodeTable() {
+        for (int i = 0; i < 256; i++) {
+            value[i] = 0xff;
+        }
+        for (int i = 0; i < 10; i++) {
+            value['0' + i] = (unsigned char)i;
+        }
+        for (int i = 0; i < 6; i++) {
+            value['a' + i] = (unsigned char)(10 + i);
+            value['A' + i] = (unsigned char)(10 + i);
+        }
+    }
+};
+
+static const DecodeTable DECODE;
+
+#ifdef NABTO_CLI_HEX_SSE2
+// encode 16 bytes to 32 hex digits
+static inline void encode16(const unsigned char* in, char* out) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letterOffset = _mm_set1_epi8('a' - '0' - 10);
+    __m128i bytes = _mm_loadu_si128((const __m128i*)in);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+    __m128i lo = _mm_and_si128(bytes, mask);
+    hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letterOffset));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letterOffset));
+    _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif
+
+void Hex::encode(const unsigned char* data, size_t length, char separator, std::string& out) {
+    size_t stride = separator ? 3 : 2;
+    size_t size = length ? length * stride - (separator ? 1 : 0) : 0;
+    out.resize(size);
+    if (length == 0) {
+        return;
+    }
+    char* p = &out[0];
+    size_t i = 0;
+#ifdef NABTO_CLI_HEX_SSE2
+    if (!separator) {
+        for (; i + 16 <= length; i += 16) {
+            encode16(data + i, p + 2 * i);
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        char* d = p + stride * i;
+        d[0] = HEX_DIGITS[data[i] >> 4];
+        d[1] = HEX_DIGITS[data[i] & 0xf];
+        if (separator && i + 1 < length) {
+            d[2] = separator;
+        }
+    }
+}
+
+std::string Hex::encode(const unsigned char* data, size_t length, char separator) {
+    std::string out;
+    encode(data, length, separator, out);
+    return out;
+}
+
+bool Hex::decode(const std::string& text, std::vector<char>& out, std::string& error) {
+    size_t length;
+    if (text.size() % 2 == 0 && text.find(':') == std::string::npos) {
+        length = text.size() / 2;
+    } else if ((text.size() + 1) % 3 == 0) {
+        length = (text.size() + 1) / 3;
+    } else {
+        error = "invalid hex length";
+        return false;
+    }
+    return decode(text, length, out, error);
+}
+
+bool Hex::decode(const std::string& text, size_t length, std::vector<char>& out, std::string& error) {
+    size_t stride;
+    if (text.size() == length * 2) {
+        stride = 2;
+    } else if (length > 0 && text.size() == length * 3 - 1) {
+        stride = 3;
+    } else {
+        error = "hex input should be " + std::to_string(length) + " bytes";
+        return false;
+    }
+    size_t offset = out.size();
+    out.resize(offset + length);
+    const unsigned char* in = (const unsigned char*)text.data();
+    // invalid digits and separators are accumulated and checked once
+    unsigned int bad = 0;
+    for (size_t i = 0; i < length; i++) {
+        const unsigned char* s = in + stride * i;
+        unsigned char hi = DECODE.value[s[0]];
+        unsigned char lo = DECODE.value[s[1]];
+        bad |= (hi | lo) & 0xf0;
+        out[offset + i] = (char)((hi << 4) | (lo & 0x0f));
+        if (stride == 3 && i + 1 < length) {
+            bad |= s[2] ^ ':';
+        }
+    }
+    if (bad) {
+        out.resize(offset);
+        error = "invalid hex character in input";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+
+namespace nabtocli {
+
+/**
+ * Table driven hex codec for PSKs and fingerprints. Decoding accepts
+ * plain ("0a1b") and colon separated ("0a:1b") input and reports errors
+ * instead of exiting.
+ */
+class Hex {
+public:
+    // lowercase hex of data, bytes separated by separator unless it is 0
+    static void encode(const unsigned char* data, size_t length, char separator, std::string& out);
+    static std::string encode(const unsigned char* data, size_t length, char separator = 0);
+
+    // decode exactly length bytes from plain or colon separated hex
+    static bool decode(const std::string& text, size_t length, std::vector<char>& out, std::string& error);
+    // decode plain or colon separated hex of any length
+    static bool decode(const std::string& text, std::vector<char>& out, std::string& error);
+};
+
+} // namespace
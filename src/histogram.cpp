@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "histogram.hpp"
+
+
+namespace nabtocli {
+
+static const int SUB_BUCKET_BITS = 5;
+static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+static int msb(uint64_t v) {
+    int r = 0;
+    while (v >>= 1) {
+        r++;
+    }
+    return r;
+}
+
+size_t Histogram::bucketIndex(uint64_t value) {
+    if (value < 2 * SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    int e = msb(value);
+    return (size_t)((e - SUB_BUCKET_BITS) * SUB_BUCKETS + (value >> (e - SUB_BUCKET_BITS)));
+}
+
+uint64_t Histogram::bucketValue(size_t index) {
+    if (index < 2 * SUB_BUCKETS) {
+        return index;
+    }
+    int e = (int)(index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+    uint64_t m = index % SUB_BUCKETS + SUB_BUCKETS;
+    return m << (e - SUB_BUCKET_BITS);
+}
+
+void Histogram::record(uint64_t value) {
+    size_t index = bucketIndex(value);
+    if (index >= counts_.size()) {
+        counts_.resize(index + 1);
+    }
+    counts_[index]++;
+    count_++;
+    sum_ += value;
+    if (value < min_) {
+        min_ = value;
+    }
+    if (value > max_) {
+        max_ = value;
+    }
+}
+
+void Histogram::merge(const Histogram& other) {
+    if (other.counts_.size() > counts_.size()) {
+        counts_.resize(other.counts_.size());
+    }
+    for (size_t i = 0; i < other.counts_.size(); i++) {
+        counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    if (other.min_ < min_) {
+        min_ = other.min_;
+    }
+    if (other.max_ > max_) {
+        max_ = other.max_;
+    }
+}
+
+void Histogram::reset() {
+    *this = Histogram();
+}
+
+double Histogram::mean() const {
+    return count_ ? (double)sum_ / count_ : 0;
+}
+
+uint64_t Histogram::percentile(double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * count_ + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); i++) {
+        seen += counts_[i];
+        if (seen >= rank) {
+            uint64_t v = bucketValue(i);
+            return v < min_ ? min_ : (v > max_ ? max_ : v);
+        }
+    }
+    return max_;
+}
+
+Json::Value Histogram::toJson(const std::string& unit) const {
+    Json::Value doc;
+    doc["count"] = (Json::UInt64)count_;
+    doc["min_" + unit] = (Json::UInt64)min();
+    doc["max_" + unit] = (Json::UInt64)max();
+    doc["mean_" + unit] = mean();
+    doc["p50_" + unit] = (Json::UInt64)percentile(50);
+    doc["p90_" + unit] = (Json::UInt64)percentile(90);
+    doc["p99_" + unit] = (Json::UInt64)percentile(99);
+    doc["p999_" + unit] = (Json::UInt64)percentile(99.9);
+    return doc;
+}
+
+} // namespace
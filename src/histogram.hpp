@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <json/json.h>
+
+#include <vector>
+#include <cstdint>
+
+
+namespace nabtocli {
+
+/**
+ * Log-linear (HDR style) histogram of non-negative integer values,
+ * e.g. latencies in microseconds. Each power of two is split into 32
+ * linear sub-buckets, which bounds the relative error of reported
+ * percentiles to about 3%.
+ */
+class Histogram {
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+    static size_t bucketIndex(uint64_t value);
+    static uint64_t bucketValue(size_t index);
+public:
+    void record(uint64_t value);
+    void merge(const Histogram& other);
+    void reset();
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const;
+    // percentile in [0;100]
+    uint64_t percentile(double p) const;
+    // count, min, max, mean and common percentiles, keys suffixed with unit
+    Json::Value toJson(const std::string& unit) const;
+};
+
+} // namespace
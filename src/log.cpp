@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "log.hpp"
+#include "spsc_queue.hpp"
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+
+
+namespace nabtocli {
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t RING_CAPACITY = 4096;
+// latency from logging to writing when nobody flushes
+static const std::chrono::milliseconds WRITER_INTERVAL(5);
+static const Clock::time_point processStart_ = Clock::now();
+
+std::atomic<int> Log::level_ { LOG_LEVEL_INFO };
+
+namespace {
+
+struct LogRecord {
+    Clock::time_point timestamp;
+    LogLevel level;
+    std::string message;
+};
+
+struct Ring {
+    Ring() : queue(RING_CAPACITY) {}
+    SpscQueue<LogRecord> queue;
+    std::atomic<uint64_t> dropped { 0 };
+    // set when the owning thread has exited, no more pushes follow
+    std::atomic<bool> closed { false };
+};
+
+struct RingHolder {
+    std::shared_ptr<Ring> ring;
+    ~RingHolder() {
+        if (ring) {
+            ring->closed = true;
+        }
+    }
+};
+
+const char* levelName(LogLevel level) {
+    switch (level) {
+    case LOG_LEVEL_TRACE: return "TRACE";
+    case LOG_LEVEL_DEBUG: return "DEBUG";
+    case LOG_LEVEL_INFO: return "INFO";
+    case LOG_LEVEL_WARN: return "WARN";
+    case LOG_LEVEL_ERROR: return "ERROR";
+    default: return "?";
+    }
+}
+
+class Writer {
+public:
+    Writer() {
+        thread_ = std::thread(&Writer::run, this);
+    }
+
+    void add(std::shared_ptr<Ring> ring) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(ring);
+    }
+
+    void flush() {
+        if (queued.load() == written_.load()) {
+            // nothing logged since the last drain, no round trip to the writer
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stop_) {
+            return;
+        }
+        uint64_t target = ++requested_;
+        wake_.notify_one();
+        done_.wait(lock, [&]() { return completed_ >= target; });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+        stopped = true;
+    }
+
+    std::atomic<bool> timestamps { false };
+    // records pushed to the rings, counted after the push
+    std::atomic<uint64_t> queued { 0 };
+    // writes are synchronous once the writer has stopped at exit
+    std::atomic<bool> stopped { false };
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            uint64_t requested = requested_;
+            bool stop = stop_;
+            std::vector<std::shared_ptr<Ring> > rings = rings_;
+            lock.unlock();
+            // everything counted here is in the rings and drained below
+            uint64_t queued = this->queued.load();
+            std::vector<bool> closed;
+            for (auto& ring : rings) {
+                closed.push_back(ring->closed);
+            }
+            drain(rings);
+            written_ = queued;
+            lock.lock();
+            // rings of exited threads were fully drained above
+            for (size_t i = 0; i < rings.size(); i++) {
+                if (closed[i]) {
+                    rings_.erase(std::find(rings_.begin(), rings_.end(), rings[i]));
+                }
+            }
+            completed_ = requested;
+            done_.notify_all();
+            if (stop) {
+                return;
+            }
+            wake_.wait_for(lock, WRITER_INTERVAL, [&]() { return stop_ || requested_ != requested; });
+        }
+    }
+
+    void drain(std::vector<std::shared_ptr<Ring> >& rings) {
+        uint64_t dropped = 0;
+        LogRecord record;
+        for (auto& ring : rings) {
+            while (ring->queue.pop(record)) {
+                batch_.push_back(std::move(record));
+            }
+            dropped += ring->dropped.exchange(0);
+        }
+        if (batch_.empty() && dropped == 0) {
+            return;
+        }
+        std::stable_sort(batch_.begin(), batch_.end(), [](const LogRecord& a, const LogRecord& b) {
+                return a.timestamp < b.timestamp;
+            });
+        out_.clear();
+        for (auto& r : batch_) {
+            if (timestamps) {
+                char prefix[32];
+                snprintf(prefix, sizeof(prefix), "[%12.6f] %-5s ",
+                         std::chrono::duration<double>(r.timestamp - processStart_).count(), levelName(r.level));
+                out_ += prefix;
+            }
+            out_ += r.message;
+            out_ += '\n';
+        }
+        if (dropped > 0) {
+            out_ += "Dropped " + std::to_string(dropped) + " log message(s), writer too slow\n";
+        }
+        batch_.clear();
+        std::cout.write(out_.data(), out_.size());
+        std::cout.flush();
+    }
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::vector<std::shared_ptr<Ring> > rings_;
+    uint64_t requested_ = 0;
+    uint64_t completed_ = 0;
+    std::atomic<uint64_t> written_ { 0 };
+    bool stop_ = false;
+    // only used by the writer thread
+    std::vector<LogRecord> batch_;
+    std::string out_;
+};
+
+thread_local RingHolder ring_;
+std::once_flag writerOnce_;
+Writer* writer_ = nullptr;
+
+void stopWriter() {
+    writer_->stop();
+}
+
+// started on first use and stopped at exit, after writing what is queued
+Writer& writer() {
+    std::call_once(writerOnce_, []() {
+            writer_ = new Writer();
+            atexit(stopWriter);
+        });
+    return *writer_;
+}
+
+} // namespace
+
+void Log::setLevel(LogLevel level) {
+    level_ = level;
+}
+
+bool Log::parseLevel(const std::string& name, LogLevel& level) {
+    for (int l = LOG_LEVEL_TRACE; l <= LOG_LEVEL_ERROR; l++) {
+        std::string n = levelName((LogLevel)l);
+        std::transform(n.begin(), n.end(), n.begin(), ::tolower);
+        if (n == name) {
+            level = (LogLevel)l;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Log::setTimestamps(bool timestamps) {
+    writer().timestamps = timestamps;
+}
+
+std::ostringstream& Log::stream() {
+    static thread_local std::ostringstream stream;
+    stream.str(std::string());
+    stream.clear();
+    return stream;
+}
+
+void Log::write(LogLevel level, std::string&& message) {
+    Writer& w = writer();
+    if (w.stopped) {
+        std::cout << message << std::endl;
+        return;
+    }
+    if (!ring_.ring) {
+        ring_.ring = std::make_shared<Ring>();
+        w.add(ring_.ring);
+    }
+    LogRecord record;
+    record.timestamp = Clock::now();
+    record.level = level;
+    record.message = std::move(message);
+    if (ring_.ring->queue.push(std::move(record))) {
+        w.queued++;
+        return;
+    }
+    if (level < LOG_LEVEL_ERROR) {
+        ring_.ring->dropped++;
+        return;
+    }
+    // errors are never dropped, wait for the writer to drain the ring
+    w.flush();
+    if (ring_.ring->queue.push(std::move(record))) {
+        w.queued++;
+        return;
+    }
+    // the writer is stopping, write directly
+    std::cout << record.message << std::endl;
+}
+
+void Log::flush() {
+    writer().flush();
+}
+
+} // namespace
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <atomic>
+
+// log statements below this level are compiled out, e.g.
+// -DNABTO_CLI_LOG_MIN_LEVEL=2 removes trace and debug logging
+#ifndef NABTO_CLI_LOG_MIN_LEVEL
+#define NABTO_CLI_LOG_MIN_LEVEL 0
+#endif
+
+
+namespace nabtocli {
+
+enum LogLevel {
+    LOG_LEVEL_TRACE = 0,
+    LOG_LEVEL_DEBUG = 1,
+    LOG_LEVEL_INFO = 2,
+    LOG_LEVEL_WARN = 3,
+    LOG_LEVEL_ERROR = 4
+};
+
+/**
+ * Asynchronous logging. Messages are queued in a bounded ring buffer
+ * owned by the logging thread and written to std::cout by a background
+ * writer, so logging never blocks on terminal I/O. Messages from all
+ * threads are written in order of their monotonic timestamps. If a
+ * ring is full, messages below error level are dropped and the count
+ * is reported; errors wait for the writer instead.
+ */
+class Log {
+public:
+    static bool enabled(LogLevel level) { return level >= level_.load(std::memory_order_relaxed); }
+    static void setLevel(LogLevel level);
+    static bool parseLevel(const std::string& name, LogLevel& level);
+    // prefix lines with seconds since start and the level
+    static void setTimestamps(bool timestamps);
+    // cleared stream for formatting a message on the calling thread
+    static std::ostringstream& stream();
+    static void write(LogLevel level, std::string&& message);
+    // block until everything logged before the call has been written,
+    // returns at once if nothing is pending
+    static void flush();
+private:
+    static std::atomic<int> level_;
+};
+
+} // namespace
+
+#define CLI_LOG(level, expr)                                            \
+    do {                                                                \
+        if ((level) >= NABTO_CLI_LOG_MIN_LEVEL && ::nabtocli::Log::enabled(level)) { \
+            std::ostringstream& cliLogStream_ = ::nabtocli::Log::stream(); \
+            cliLogStream_ << expr;                                      \
+            ::nabtocli::Log::write(level, cliLogStream_.str());         \
+        }                                                               \
+    } while (0)
+
+#define CLI_LOG_TRACE(expr) CLI_LOG(::nabtocli::LOG_LEVEL_TRACE, expr)
+#define CLI_LOG_DEBUG(expr) CLI_LOG(::nabtocli::LOG_LEVEL_DEBUG, expr)
+#define CLI_LOG_INFO(expr) CLI_LOG(::nabtocli::LOG_LEVEL_INFO, expr)
+#define CLI_LOG_WARN(expr) CLI_LOG(::nabtocli::LOG_LEVEL_WARN, expr)
+#define CLI_LOG_ERROR(expr) CLI_LOG(::nabtocli::LOG_LEVEL_ERROR, expr)
@@ -3,6 +3,24 @@
  */
 
 #include "tunnel_manager.hpp"
+#include "tunnel_bench.hpp"
+#include "rpc_batch.hpp"
+#include "cert_index.hpp"
+#include "hex.hpp"
+#include "psk_keyring.hpp"
+#include "signals.hpp"
+#include "rpc_timing.hpp"
+#include "output.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "flight_recorder.hpp"
+#include "scenario.hpp"
+#include "circuit_breaker.hpp"
+#include "prewarm.hpp"
+#include "poller.hpp"
+#include "change_filter.hpp"
+#include "result_log.hpp"
+#include "rpc_url.hpp"
 #include "nabto_client_api.h"
 #include "cxxopts.hpp"
 #include <json/json.h>
@@ -12,23 +30,53 @@
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <set>
+#include <atomic>
+#include <sstream>
+#include <iterator>
+#include <iomanip>
+#include <climits>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
 
 #ifndef WIN32
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
 #endif
 
 
 namespace nabtocli {
 
 static std::unique_ptr<TunnelManager> tunnelManager_;
+static bool started_ = false;
+static bool resourcesInstalled_ = false;
+static std::unique_ptr<PskKeyring> pskKeyring_;
+static std::unique_ptr<CircuitBreaker> breaker_;
+static std::unique_ptr<Prewarmer> prewarmer_;
+static std::unique_ptr<ResultLog> resultLog_;
 
-void sigHandler(int signo) {
-#ifndef WIN32
-    if (signo == SIGINT && tunnelManager_) {
-        tunnelManager_->stop();
+// exit status when a call fails fast on an open circuit breaker (EX_TEMPFAIL)
+static const int EXIT_CIRCUIT_OPEN = 75;
+
+static std::string timingFile_;
+
+void timingDumpAtExit() {
+    RpcTiming::dump(timingFile_);
+}
+
+void timingEnable(cxxopts::Options& options) {
+    if (options.count("rpc-timing-file")) {
+        timingFile_ = options["rpc-timing-file"].as<std::string>();
     }
-    nabtoShutdown();
-    exit(0);
+    RpcTiming::enable();
+    atexit(timingDumpAtExit);
+#ifndef WIN32
+    SignalDispatcher::onSignal(SIGUSR1, []() { RpcTiming::dump(timingFile_); });
 #endif
 }
 
@@ -36,62 +84,250 @@ void help(cxxopts::Options& options) {
     std::cout << options.help({"", "Group"}) << std::endl;
 }
 
-void die(const std::string& msg, int status=1) {
-    std::cout << msg << std::endl;
-    nabtoShutdown();
+void shutdown(int status) {
+    if (started_) {
+        nabtoShutdown();
+    }
+    ShutdownCoordinator::completed();
     exit(status);
 }
 
-bool init(cxxopts::Options& options) {
-    nabto_status_t st;
+void die(const std::string& msg, int status=1) {
+    FlightRecorder::record(FlightRecorder::EVENT_ERROR, status, 0, msg.c_str());
+    if (Output::ndjson() && !msg.empty()) {
+        Json::Value event = Output::event("error");
+        event["message"] = msg;
+        Output::emit(event);
+    } else {
+        CLI_LOG_ERROR(msg);
+    }
+    shutdown(status);
+}
+
+/**
+ * The Nabto home dir, the SDK default is used unless overridden with
+ * --home-dir. Empty if it cannot be determined.
+ */
+std::string nabtoHomeDir(cxxopts::Options& options) {
     if (options.count("home-dir")) {
-        st = nabtoStartup(options["home-dir"].as<std::string>().c_str());
+        return options["home-dir"].as<std::string>();
+    }
+#ifdef WIN32
+    const char* appData = getenv("APPDATA");
+    return appData ? std::string(appData) + "\\Nabto" : "";
+#else
+    const char* home = getenv("HOME");
+    return home ? std::string(home) + "/.nabto" : "";
+#endif
+}
+
+void startupProfile(cxxopts::Options& options, const char* phase, std::chrono::steady_clock::time_point start) {
+    if (Trace::enabled()) {
+        Trace::span(phase, "init", start, std::chrono::steady_clock::now());
+    }
+    if (!options.count("startup-profile")) {
+        return;
+    }
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("startup_profile");
+        event["phase"] = phase;
+        event["duration_us"] = (Json::Int64)us;
+        Output::emit(event);
     } else {
-        st = nabtoStartup(NULL);
+        CLI_LOG_INFO("Startup phase " << phase << ": " << us << " us");
+    }
+}
+
+/**
+ * Install the default static resources unless a stamp in the home dir
+ * shows they were already installed by this SDK version.
+ */
+bool installResources(cxxopts::Options& options) {
+    auto start = std::chrono::steady_clock::now();
+    std::string stampFile;
+    std::string version;
+    std::string home = nabtoHomeDir(options);
+    char* versionStr;
+    if (!home.empty() && nabtoVersionString(&versionStr) == NABTO_OK) {
+        version = versionStr;
+        nabtoFree(versionStr);
+        stampFile = home + "/nabto-cli-resources.stamp";
+        std::ifstream ifs(stampFile.c_str());
+        std::string stamp;
+        if (std::getline(ifs, stamp) && stamp == version) {
+            startupProfile(options, "resources_skipped", start);
+            return true;
+        }
+    }
+    if (nabtoInstallDefaultStaticResources(NULL) != NABTO_OK) {
+        return false;
     }
+    if (!stampFile.empty()) {
+        std::ofstream ofs(stampFile.c_str(), std::ofstream::out | std::ofstream::trunc);
+        ofs << version << std::endl;
+    }
+    startupProfile(options, "resources_installed", start);
+    return true;
+}
+
+/**
+ * Dump recent events on fatal signals and on SIGUSR2, by default to a
+ * per process file in the home dir.
+ */
+void flightRecorderInstall(cxxopts::Options& options) {
 #ifndef WIN32
-    signal(SIGINT, sigHandler);
+    std::string file;
+    if (options.count("flight-recorder-file")) {
+        file = options["flight-recorder-file"].as<std::string>();
+    } else {
+        std::string home = nabtoHomeDir(options);
+        if (home.empty()) {
+            return;
+        }
+        file = home + "/nabto-cli-flight-recorder." + std::to_string(getpid()) + ".log";
+    }
+    if (!FlightRecorder::install(file)) {
+        CLI_LOG_WARN("Could not install flight recorder dumping to " << file);
+        return;
+    }
+    SignalDispatcher::onSignal(SIGUSR2, []() {
+            if (FlightRecorder::dump()) {
+                CLI_LOG_INFO("Flight recorder dumped to " << FlightRecorder::file());
+            } else {
+                CLI_LOG_ERROR("Failed to dump flight recorder to " << FlightRecorder::file());
+            }
+        });
 #endif
-    return st == NABTO_OK && nabtoInstallDefaultStaticResources(NULL) == NABTO_OK;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// cert
+/**
+ * Share per device circuit breakers with other nabto-cli processes
+ * through a file in the home dir.
+ */
+void breakerInstall(cxxopts::Options& options) {
+    if (!options.count("circuit-breaker")) {
+        return;
+    }
+    std::string home = nabtoHomeDir(options);
+    std::string file = home + "/nabto-cli-breakers";
+    breaker_.reset(new CircuitBreaker(options["breaker-threshold"].as<int>(),
+                                      std::chrono::seconds(options["breaker-probe-interval"].as<int>())));
+    if (home.empty() || !breaker_->open(file)) {
+        CLI_LOG_WARN("Could not open circuit breaker file " << file << ", circuit breakers disabled");
+        breaker_.reset();
+    }
+}
 
-unsigned char parseHex(char c)
-{
-    if ('0' <= c && c <= '9') return c - '0';
-    if ('A' <= c && c <= 'F') return c - 'A' + 10;
-    if ('a' <= c && c <= 'f') return c - 'a' + 10;
-    die("Invalid hex character in input");
-    return false;
+// false if calls to the device should fail fast
+bool breakerAllow(const std::string& device) {
+    return !breaker_ || breaker_->allow(device);
+}
+
+// only outcomes that tell whether the device could be reached count
+void breakerRecord(const std::string& device, nabto_status_t status) {
+    if (!breaker_) {
+        return;
+    }
+    switch (status) {
+    case NABTO_OK:
+    case NABTO_FAILED_WITH_JSON_MESSAGE:
+        breaker_->record(device, true);
+        break;
+    case NABTO_CONNECT_TO_HOST_FAILED:
+    case NABTO_RPC_DEVICE_OFFLINE:
+    case NABTO_RPC_RESOLVE_ERROR:
+    case NABTO_RPC_COMMUNICATION_PROBLEM:
+        breaker_->record(device, false);
+        break;
+    default:
+        break;
+    }
+}
+
+void resultLogCloseAtExit() {
+    resultLog_->close();
+}
+
+// append every RPC result to the binary log in --result-log
+bool resultLogInstall(cxxopts::Options& options) {
+    if (!options.count("result-log")) {
+        return true;
+    }
+    resultLog_.reset(new ResultLog(options["result-log"].as<std::string>(),
+                                   (uint64_t)options["result-log-segment-mb"].as<int>() * 1024 * 1024));
+    std::string error;
+    if (!resultLog_->open(error)) {
+        CLI_LOG_ERROR("Could not open result log: " << error);
+        resultLog_.reset();
+        return false;
+    }
+    atexit(resultLogCloseAtExit);
+    return true;
 }
 
-bool parseHexString(std::vector<char>& parsed, const std::string& text, int offset) {
-    for (std::size_t i = 0; i < (text.size() + offset-2) / offset; i++) {
-        char l = 16 * parseHex(text[offset * i]) + parseHex(text[offset * i + 1]);
-        parsed.push_back(l);
+/**
+ * Start the SDK, and install static resources if the command needs
+ * them. Commands call this lazily, so --help and option errors never
+ * pay for SDK startup.
+ */
+bool init(cxxopts::Options& options, bool resources) {
+    if (!started_) {
+        auto start = std::chrono::steady_clock::now();
+        nabto_status_t st;
+        if (options.count("home-dir")) {
+            st = nabtoStartup(options["home-dir"].as<std::string>().c_str());
+        } else {
+            st = nabtoStartup(NULL);
+        }
+        if (st != NABTO_OK) {
+            return false;
+        }
+        started_ = true;
+        ShutdownCoordinator::install(std::chrono::milliseconds(options["shutdown-timeout"].as<int>()));
+        flightRecorderInstall(options);
+        breakerInstall(options);
+        if (!resultLogInstall(options)) {
+            return false;
+        }
+        startupProfile(options, "startup", start);
+    }
+    if (resources && !resourcesInstalled_) {
+        if (!installResources(options)) {
+            return false;
+        }
+        resourcesInstalled_ = true;
     }
     return true;
 }
 
+void initOrDie(cxxopts::Options& options, bool resources) {
+    if (!init(options, resources)) {
+        die("Initialization failed");
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// cert
+
 bool pskParseHex(std::vector<char>& parsed, const std::string& text, int length) {
-    int offset;
-    if (text.size() == length * 2) {
-        offset = 2;
-    } else if (text.size() == length * 3 - 1) {
-        offset = 3;
-    } else {
-        std::cout << "hex input should be " << length << " hex characters" << std::endl;
+    std::string error;
+    if (!Hex::decode(text, length, parsed, error)) {
+        CLI_LOG_ERROR("Invalid PSK: " << error);
         return false;
     }
-    return parseHexString(parsed, text, offset);
+    return true;
 }
 
 bool pskSetKeyIfPresent(nabto_handle_t session, const std::string& host, cxxopts::Options& options) {
+    if (pskKeyring_ && pskKeyring_->contains(host)) {
+        RpcPhaseTimer timer("psk_setup", host);
+        return pskKeyring_->apply(session, host);
+    }
     if (!(options.count("local-connection-psk-id") && options.count("local-connection-psk"))) {
         return true;
     }
+    RpcPhaseTimer timer("psk_setup", host);
     std::string pskId = options["local-connection-psk-id"].as<std::string>();
     std::string psk = options["local-connection-psk"].as<std::string>();
 
@@ -112,36 +348,328 @@ bool getFingerprintString(const std::string& commonName, std::string& fingerprin
     if (st != NABTO_OK) {
         return false;
     }
-    char buf[3*sizeof(fingerprint)];
-    for (size_t i=0; i<sizeof(fingerprint)-1; i++) {
-        sprintf(buf+3*i, "%02x:", (unsigned char)(fingerprint[i]));
-    }
-    sprintf(buf+3*15, "%02x", (unsigned char)(fingerprint[15]));
-    fingerprintString = std::string(buf);
+    Hex::encode((const unsigned char*)fingerprint, sizeof(fingerprint), ':', fingerprintString);
     return true;
 
 }
 
 bool certCreate(const std::string& commonName, const std::string& password) {
     if ( password.compare("not-so-secret") == 0 ){
-        std::cout << "Warning: creating certificate with default password for user: " << commonName << std::endl;
+        CLI_LOG_WARN("Warning: creating certificate with default password for user: " << commonName);
     }
     nabto_status_t st = nabtoCreateSelfSignedProfile(commonName.c_str(), password.c_str());
     if (st != NABTO_OK) {
-        std::cout << "Failed to create self signed certificate " << st << std::endl;
+        CLI_LOG_ERROR("Failed to create self signed certificate " << st);
         return false;
     }
     std::string fingerprint;
     if (getFingerprintString(commonName, fingerprint)) {
-        std::cout << "Created self signed cert with fingerprint [" << fingerprint << "]" << std::endl;
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("cert_created");
+            event["name"] = commonName;
+            event["fingerprint"] = fingerprint;
+            Output::emit(event);
+        } else {
+            Output::results() << "Created self signed cert with fingerprint [" << fingerprint << "]" << std::endl;
+        }
         return true;
     } else {
-        std::cout << "Failed to get fingerprint of self signed certificate " << st << std::endl;
+        CLI_LOG_ERROR("Failed to get fingerprint of self signed certificate " << st);
+        return false;
+    }
+}
+
+std::string csvField(const std::string& field) {
+    if (field.find_first_of(",\"\n") == std::string::npos) {
+        return field;
+    }
+    std::string quoted = "\"";
+    for (auto c : field) {
+        if (c == '"') {
+            quoted.push_back('"');
+        }
+        quoted.push_back(c);
+    }
+    quoted.push_back('"');
+    return quoted;
+}
+
+// argv before option parsing, used to start cert batch workers
+static std::vector<std::string> commandLine_;
+
+struct CertBatchEntry {
+    std::string name;
+    std::string password;
+    std::string fingerprint;
+    std::string status;
+    bool reported = false;
+};
+
+void certBatchCreate(CertBatchEntry& cert) {
+    nabto_status_t st = nabtoCreateSelfSignedProfile(cert.name.c_str(), cert.password.c_str());
+    cert.status = "ok";
+    if (st != NABTO_OK) {
+        cert.status = nabtoStatusStr(st);
+    } else if (!getFingerprintString(cert.name, cert.fingerprint)) {
+        cert.status = "fingerprint failed";
+    }
+}
+
+void certBatchReport(CertBatchEntry& cert) {
+    cert.reported = true;
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("cert_created");
+        event["name"] = cert.name;
+        event["fingerprint"] = cert.fingerprint;
+        event["status"] = cert.status;
+        Output::emit(event);
+    } else {
+        Output::results() << csvField(cert.name) << "," << cert.fingerprint << "," << csvField(cert.status) << std::endl;
+    }
+}
+
+#ifndef WIN32
+// fd on which a worker reports "<index> <fingerprint or -> <status>" lines
+static const int CERT_BATCH_RESULT_FD = 3;
+
+bool certBatchParseLine(const std::string& line, std::vector<CertBatchEntry>& certs) {
+    std::istringstream iss(line);
+    size_t index;
+    std::string fingerprint;
+    if (!(iss >> index >> fingerprint) || index >= certs.size() || certs[index].reported) {
+        return false;
+    }
+    CertBatchEntry& cert = certs[index];
+    cert.fingerprint = fingerprint == "-" ? "" : fingerprint;
+    iss.ignore(1);
+    std::getline(iss, cert.status);
+    certBatchReport(cert);
+    return true;
+}
+
+/**
+ * Run this command again in count worker processes, worker i creating
+ * every count'th cert starting at i. Each worker starts its own SDK, so
+ * profile creation runs in parallel without sharing the SDK between
+ * threads. Workers log to stderr and report results on a pipe, the
+ * manifest is written here as results arrive. Certs of a worker that
+ * fails are reported as "worker failed".
+ */
+void certBatchSpawn(std::vector<CertBatchEntry>& certs, unsigned count) {
+    struct Worker {
+        pid_t pid;
+        int fd;
+        std::string pending;
+    };
+    std::vector<Worker> workers;
+    for (unsigned i = 0; i < count; i++) {
+        std::vector<std::string> args = commandLine_;
+        args.push_back("--cert-batch-shard");
+        args.push_back(std::to_string(i) + "/" + std::to_string(count));
+        // prepared before fork, the child may only make async-signal-safe calls
+        std::vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back(&arg[0]);
+        }
+        argv.push_back(0);
+        int fds[2];
+        if (pipe(fds) != 0) {
+            CLI_LOG_ERROR("Could not create pipe for cert worker " << i);
+            continue;
+        }
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (fds[1] == CERT_BATCH_RESULT_FD) {
+                fcntl(fds[1], F_SETFD, 0);
+            } else {
+                dup2(fds[1], CERT_BATCH_RESULT_FD);
+            }
+            // keep the manifest on stdout free of worker log lines
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            execv("/proc/self/exe", argv.data());
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        close(fds[1]);
+        if (pid < 0) {
+            CLI_LOG_ERROR("Could not start cert worker " << i);
+            close(fds[0]);
+            continue;
+        }
+        workers.push_back(Worker { pid, fds[0], "" });
+    }
+
+    std::vector<struct pollfd> polled;
+    for (auto& w : workers) {
+        polled.push_back(pollfd { w.fd, POLLIN, 0 });
+    }
+    char buffer[4096];
+    while (!polled.empty()) {
+        if (poll(polled.data(), polled.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (size_t i = 0; i < polled.size(); ) {
+            if (polled[i].revents == 0) {
+                i++;
+                continue;
+            }
+            Worker& w = *std::find_if(workers.begin(), workers.end(), [&](const Worker& x) { return x.fd == polled[i].fd; });
+            ssize_t n = read(w.fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                i++;
+                continue;
+            }
+            if (n <= 0) {
+                close(w.fd);
+                polled.erase(polled.begin() + i);
+                continue;
+            }
+            w.pending.append(buffer, n);
+            size_t newline;
+            while ((newline = w.pending.find('\n')) != std::string::npos) {
+                if (!certBatchParseLine(w.pending.substr(0, newline), certs)) {
+                    CLI_LOG_WARN("Ignoring invalid cert worker result: " << w.pending.substr(0, newline));
+                }
+                w.pending.erase(0, newline + 1);
+            }
+            i++;
+        }
+    }
+    for (auto& w : workers) {
+        int status;
+        while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    for (auto& cert : certs) {
+        if (!cert.reported) {
+            cert.status = "worker failed";
+            certBatchReport(cert);
+        }
+    }
+}
+
+// worker side of certBatchSpawn, shard is "<index>/<count>"
+bool certBatchWorker(std::vector<CertBatchEntry>& certs, const std::string& shard) {
+    unsigned index, count;
+    char end;
+    if (sscanf(shard.c_str(), "%u/%u%c", &index, &count, &end) != 2 || count == 0 || index >= count) {
+        CLI_LOG_ERROR("Invalid cert batch shard: " << shard);
+        return false;
+    }
+    FILE* results = fdopen(CERT_BATCH_RESULT_FD, "w");
+    if (!results) {
+        CLI_LOG_ERROR("Cert batch worker has no result pipe");
+        return false;
+    }
+    setvbuf(results, NULL, _IOLBF, 0);
+    for (size_t i = index; i < certs.size(); i += count) {
+        certBatchCreate(certs[i]);
+        fprintf(results, "%zu %s %s\n", i, certs[i].fingerprint.empty() ? "-" : certs[i].fingerprint.c_str(), certs[i].status.c_str());
+    }
+    return fclose(results) == 0;
+}
+#endif
+
+/**
+ * Create a self signed cert for each line of "<name>[,<password>]" in
+ * file, and write a manifest of name, fingerprint and status (CSV, or
+ * NDJSON events with --output ndjson). Repeated names are only created
+ * once. The SDK does not document nabtoCreateSelfSignedProfile as thread
+ * safe, so the list is split over one worker process per core instead
+ * of threads; without fork the certs are created one at a time. A
+ * non-empty shard makes this process such a worker.
+ */
+bool certCreateBatch(const std::string& file, const std::string& defaultPassword, const std::string& shard) {
+    std::ifstream ifs(file.c_str(), std::ifstream::in);
+    if (!ifs.good()) {
+        CLI_LOG_ERROR("Failed to open cert list file: " << file);
         return false;
     }
+    std::vector<CertBatchEntry> certs;
+    std::set<std::string> names;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        size_t comma = line.find(',');
+        CertBatchEntry cert;
+        cert.name = line.substr(0, comma);
+        if (!names.insert(cert.name).second) {
+            if (shard.empty()) {
+                CLI_LOG_WARN("Skipping repeated cert name " << cert.name);
+            }
+            continue;
+        }
+        cert.password = comma == std::string::npos ? defaultPassword : line.substr(comma + 1);
+        certs.push_back(cert);
+    }
+#ifndef WIN32
+    if (!shard.empty()) {
+        return certBatchWorker(certs, shard);
+    }
+#endif
+    for (auto&& cert : certs) {
+        if (cert.password.compare("not-so-secret") == 0) {
+            CLI_LOG_WARN("Warning: creating certificates with default password");
+            break;
+        }
+    }
+
+    if (!Output::ndjson()) {
+        Output::results() << "name,fingerprint,status" << std::endl;
+    }
+    auto start = std::chrono::steady_clock::now();
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = (unsigned)std::min<size_t>(workers, certs.size());
+#ifndef WIN32
+    if (workers > 1) {
+        certBatchSpawn(certs, workers);
+    } else
+#endif
+    {
+        for (auto&& cert : certs) {
+            certBatchCreate(cert);
+            certBatchReport(cert);
+        }
+    }
+    size_t created = 0;
+    for (auto&& cert : certs) {
+        if (!cert.fingerprint.empty()) {
+            created++;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double rate = seconds > 0 ? created / seconds : 0;
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("cert_batch_stats");
+        event["requested"] = (Json::UInt64)certs.size();
+        event["created"] = (Json::UInt64)created;
+        event["workers"] = workers;
+        event["seconds"] = seconds;
+        event["certs_per_second"] = rate;
+        Output::emit(event);
+    } else {
+        // stderr, stdout only carries the manifest
+        Log::flush();
+        std::cerr << "Created " << created << " of " << certs.size() << " certs in " << seconds << " s (" << rate << " certs/s, " << workers << " workers)" << std::endl;
+    }
+    return created == certs.size();
 }
 
-bool certList() {
+/**
+ * List certificates, or only those matching fingerprint if not empty.
+ * Fingerprints are looked up in the cert index in the home dir.
+ */
+bool certList(cxxopts::Options& options, const std::string& fingerprint) {
     char** certificates;
     int certificatesLength;
     nabto_status_t status;
@@ -152,21 +680,41 @@ bool certList() {
         return false;
     }
 
+    CertIndex index(nabtoHomeDir(options), getFingerprintString);
+    index.load();
+    std::set<std::string> names;
+    bool found = false;
     for (int i = 0; i < certificatesLength; i++) {
-        std::string fingerprint;
-        if (getFingerprintString(certificates[i], fingerprint)) {
-            std::cout << fingerprint << " " << certificates[i] << std::endl;
+        names.insert(certificates[i]);
+        std::string certFingerprint;
+        if (!index.fingerprint(certificates[i], certFingerprint)) {
+            continue;
+        }
+        if (!fingerprint.empty() && certFingerprint != fingerprint) {
+            continue;
+        }
+        found = true;
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("cert");
+            event["name"] = certificates[i];
+            event["fingerprint"] = certFingerprint;
+            Output::emit(event);
+        } else {
+            Output::results() << certFingerprint << " " << certificates[i] << std::endl;
         }
     }
+    index.retain(names);
+    index.save();
 
     for (int i = 0; i < certificatesLength; i++) {
         nabtoFree(certificates[i]);
     }
     nabtoFree(certificates);
-    return true;
+    return fingerprint.empty() || found;
 }
 
 bool certOpenSession(nabto_handle_t& session, cxxopts::Options& options) {
+    RpcPhaseTimer timer("session_open");
     const std::string& cert = options["cert-name"].as<std::string>();
     const std::string& passwd = options["password"].as<std::string>();
     nabto_status_t status = nabtoOpenSession(&session, cert.c_str(), passwd.c_str());
@@ -176,15 +724,17 @@ bool certOpenSession(nabto_handle_t& session, cxxopts::Options& options) {
             if (nabtoSetBasestationAuthJson(session, json.c_str()) == NABTO_OK) {
                 return true;
             } else {
-                std::cout << "Cert opened ok, but could not set basestation auth json doc" << std::endl;
+                CLI_LOG_ERROR("Cert opened ok, but could not set basestation auth json doc");
                 return false;
             }
         }
         return true;
-    } else if (status == NABTO_OPEN_CERT_OR_PK_FAILED) {
-        std::cout << "No such certificate " << cert << std::endl;
+    }
+    FlightRecorder::record(FlightRecorder::EVENT_ERROR, status, 0, cert.c_str(), nabtoStatusStr(status));
+    if (status == NABTO_OPEN_CERT_OR_PK_FAILED) {
+        CLI_LOG_ERROR("No such certificate " << cert);
     } else if (status == NABTO_UNLOCK_PK_FAILED) {
-        std::cout << "Invalid password specified for " << cert << std::endl;
+        CLI_LOG_ERROR("Invalid password specified for " << cert);
     }
     return false;
 }
@@ -196,6 +746,7 @@ bool certOpenSession(nabto_handle_t& session, cxxopts::Options& options) {
 // rpc
 
 bool rpcSetInterface(nabto_handle_t session, const std::string& file) {
+    RpcPhaseTimer timer("interface_load");
     std::string content;
     bool ok = false;
 
@@ -204,7 +755,7 @@ bool rpcSetInterface(nabto_handle_t session, const std::string& file) {
         content = std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
         ok = true;
     } else {
-        std::cout << "Failed to open queries file: " << file << std::endl;
+        CLI_LOG_ERROR("Failed to open queries file: " << file);
         ok = false;
     }
     ifs.close();
@@ -214,18 +765,19 @@ bool rpcSetInterface(nabto_handle_t session, const std::string& file) {
     char* error;
     nabto_status_t status = nabtoRpcSetDefaultInterface(session, content.c_str(), &error);
     if (status == NABTO_FAILED_WITH_JSON_MESSAGE) {
-        std::cout << error << std::endl;
+        CLI_LOG_ERROR(error);
         nabtoFree(error);
     }
     return status == NABTO_OK;
 }
 
 bool checkInterface(nabto_handle_t session, std::string device, cxxopts::Options& options) {
+    RpcPhaseTimer timer("interface_check", device);
     if (!options.count("interface-id") || !options.count("interface-version")) {
-        std::cout << "ERROR: strict-interface-check was given, but interface-id or interface-version was missing" << std::endl;
+        CLI_LOG_ERROR("ERROR: strict-interface-check was given, but interface-id or interface-version was missing");
         return false;
     } else if (options["interface-version"].as<std::string>().find(".") == std::string::npos) {
-        std::cout << "ERROR: Badly formatted version string: " << options["interface-version"].as<std::string>() << std::endl;
+        CLI_LOG_ERROR("ERROR: Badly formatted version string: " << options["interface-version"].as<std::string>());
         return false;
     }
 
@@ -235,20 +787,19 @@ bool checkInterface(nabto_handle_t session, std::string device, cxxopts::Options
         localMajor = std::stoi(localVersion);
         localMinor = std::stoi(std::string(&localVersion[localVersion.find(".")+1]));
     } catch (std::invalid_argument) {
-        std::cout << "ERROR: invalid version provided: " << options["interface-version"].as<std::string>() << std::endl;
+        CLI_LOG_ERROR("ERROR: invalid version provided: " << options["interface-version"].as<std::string>());
         return false;
     }
     if (localMajor < 1 || localMinor < 0) {
-        std::cout << "ERROR: invalid version provided: " << options["interface-version"].as<std::string>() << std::endl;
+        CLI_LOG_ERROR("ERROR: invalid version provided: " << options["interface-version"].as<std::string>());
         return false;
     }
 
-    std::string interfaceString("nabto://");
-    interfaceString.append(device);
-    interfaceString.append("/get_interface_info.json");
+    RpcUrlBuilder url;
+    url.reset(device, "get_interface_info.json");
     char* json;
 
-    nabto_status status = nabtoRpcInvoke(session, interfaceString.c_str(), &json);
+    nabto_status status = nabtoRpcInvoke(session, url.c_str(), &json);
     if (status == NABTO_OK) {
         Json::Value jsonDoc;
         nabto::JsonHelper::parse(std::string(json),jsonDoc);
@@ -258,35 +809,156 @@ bool checkInterface(nabto_handle_t session, std::string device, cxxopts::Options
         std::string interfaceId = options["interface-id"].as<std::string>();
 
         if (interfaceId.compare(jsonDoc["response"]["interface_id"].asString()) != 0) {
-            std::cout << "ERROR: Interface ID mismatch: " << interfaceId << " != " << jsonDoc["response"]["interface_id"] << std::endl;
+            CLI_LOG_ERROR("ERROR: Interface ID mismatch: " << interfaceId << " != " << jsonDoc["response"]["interface_id"]);
             return false;
         } else if (major != localMajor || minor < localMinor) {
-            std::cout << "ERROR: interface version mismatch between: " << major << "." << minor << " and " << localMajor << "." << localMinor << std::endl;
+            CLI_LOG_ERROR("ERROR: interface version mismatch between: " << major << "." << minor << " and " << localMajor << "." << localMinor);
             return false;
         } else {
             return true;
         }
     } else if(status == NABTO_FAILED_WITH_JSON_MESSAGE) {
-        std::cout << json << std::endl;
+        CLI_LOG_ERROR(json);
         nabtoFree(json);
     } else {
-        std::cout << "RPC invocation failed with status " << status << std::endl;
+        CLI_LOG_ERROR("RPC invocation failed with status " << status);
         nabtoFree(json);
         return false;
     }
     return true;
 }
 
-bool extractHostFromUrl(const std::string& url, std::string& host) {
-    std::string prefix = "nabto://";
-    size_t hostStart = prefix.length();
-    size_t slash = url.find("/", hostStart);
-    if (slash != std::string::npos) {
-        host = std::string(&url[hostStart],slash-hostStart);
-        return true;
+void printRpcResult(const std::string& url, nabto_status_t status, const char* json) {
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("rpc_result");
+        event["url"] = url;
+        event["status"] = status;
+        if (status == NABTO_OK || status == NABTO_FAILED_WITH_JSON_MESSAGE) {
+            event["result"] = Output::sdkJson(json);
+        } else {
+            event["error"] = json ? json : nabtoStatusStr(status);
+        }
+        Output::emit(event);
+    } else if (status == NABTO_OK || status == NABTO_FAILED_WITH_JSON_MESSAGE) {
+        Output::results() << json << std::endl;
+    } else if (json) {
+        Output::results() << json << std::endl;
     } else {
+        Output::results() << "RPC invocation of " << url << " failed with status " << status << std::endl;
+    }
+}
+
+/**
+ * Strict interface check and PSK setup for a host before invoking RPCs
+ * on it.
+ */
+bool rpcPrepareHost(nabto_handle_t session, const std::string& host, cxxopts::Options& options) {
+    if (options.count("strict-interface-check") && !checkInterface(session, host, options)) {
+        CLI_LOG_ERROR("ERROR: strict interface check failed for " << host);
+        return false;
+    }
+    if (!pskSetKeyIfPresent(session, host, options)) {
+        CLI_LOG_ERROR("ERROR: could not set PSK for " << host);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Remembers the outcome of rpcPrepareHost per host, such that the
+ * interface check and PSK setup is done once per host on a session.
+ * Different hosts are prepared in parallel; concurrent callers for a
+ * host that is being prepared wait for that outcome.
+ */
+class PreparedHosts {
+public:
+    PreparedHosts(cxxopts::Options& options) : options_(options) {}
+    bool prepare(nabto_handle_t session, const std::string& host) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = hosts_.find(host);
+        if (it != hosts_.end()) {
+            cond_.wait(lock, [&]() { return it->second != PREPARING; });
+            return it->second == READY;
+        }
+        hosts_[host] = PREPARING;
+        lock.unlock();
+        // may make a round trip to the device, other hosts must not wait for it
+        bool ok = rpcPrepareHost(session, host, options_);
+        lock.lock();
+        hosts_[host] = ok ? READY : FAILED;
+        cond_.notify_all();
+        return ok;
+    }
+private:
+    enum State { PREPARING, READY, FAILED };
+    cxxopts::Options& options_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::map<std::string, State> hosts_;
+};
+
+// timed invocation, result is the JSON response or error message if any
+nabto_status_t rpcInvokeUrl(nabto_handle_t session, const std::string& host, const std::string& url, std::string& result) {
+    char* json;
+    nabto_status_t status;
+    RpcUrl view;
+    if (!view.parse(url)) {
+        result = "ERROR: bad url " + url;
+        return NABTO_ILLEGAL_PARAMETER;
+    }
+    auto start = std::chrono::steady_clock::now();
+    {
+        RpcPhaseTimer timer("rpc_invoke", host, view.path().str());
+        status = nabtoRpcInvoke(session, url.c_str(), &json);
+    }
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    FlightRecorder::record(FlightRecorder::EVENT_RPC, status, us, url.c_str(), status == NABTO_OK ? 0 : nabtoStatusStr(status));
+    breakerRecord(host, status);
+    if (status == NABTO_OK || status == NABTO_FAILED_WITH_JSON_MESSAGE) {
+        result = json;
+        nabtoFree(json);
+    }
+    if (resultLog_) {
+        resultLog_->append(host, view.request().str(), status, (uint32_t)us, result);
+    }
+    return status;
+}
+
+/**
+ * Connect to the --prewarm devices in parallel before the command uses
+ * them, and keep the connections alive until prewarmStop. The session
+ * must have an RPC interface set.
+ */
+bool prewarmStart(nabto_handle_t session, cxxopts::Options& options) {
+    if (!options.count("prewarm")) {
+        return true;
+    }
+    std::vector<std::string> devices;
+    if (!Prewarmer::parseDevices(options["prewarm"].as<std::string>(), devices)) {
+        CLI_LOG_ERROR("Invalid or empty prewarm device list: " << options["prewarm"].as<std::string>());
         return false;
     }
+    std::shared_ptr<PreparedHosts> hosts = std::make_shared<PreparedHosts>(options);
+    std::string query = options["prewarm-query"].as<std::string>();
+    prewarmer_.reset(new Prewarmer([session, hosts, query](const std::string& device) {
+                if (!breakerAllow(device)) {
+                    return NABTO_ABORTED;
+                }
+                if (!hosts->prepare(session, device)) {
+                    return NABTO_FAILED;
+                }
+                RpcUrlBuilder url;
+                std::string result;
+                return rpcInvokeUrl(session, device, url.reset(device, query).str(), result);
+            }, std::chrono::seconds(options["prewarm-keepalive"].as<int>())));
+    prewarmer_->warm(devices);
+    return true;
+}
+
+void prewarmStop() {
+    if (prewarmer_) {
+        prewarmer_->stop();
+    }
 }
 
 bool rpcInvoke(cxxopts::Options& options) {
@@ -299,11 +971,17 @@ bool rpcInvoke(cxxopts::Options& options) {
     }
     std::string host;
     if (!extractHostFromUrl(options["rpc-invoke-url"].as<std::string>(), host)) {
-        std::cout << "ERROR: bad url" << std::endl;
+        CLI_LOG_ERROR("ERROR: bad url");
         return false;
     }
+    if (!prewarmStart(session, options)) {
+        return false;
+    }
+    if (!breakerAllow(host)) {
+        die("Circuit breaker for " + host + " is open, failing fast", EXIT_CIRCUIT_OPEN);
+    }
     if (options.count("strict-interface-check") && !checkInterface(session, host, options)) {
-        std::cout << "ERROR: strict interface check failed" << std::endl;
+        CLI_LOG_ERROR("ERROR: strict interface check failed");
         return false;
     }
 
@@ -311,14 +989,11 @@ bool rpcInvoke(cxxopts::Options& options) {
         die("Could not set PSK");
     }
 
-    char* json;
-    nabto_status status = nabtoRpcInvoke(session, options["rpc-invoke-url"].as<std::string>().c_str(), &json);
-    if (status == NABTO_OK || status == NABTO_FAILED_WITH_JSON_MESSAGE) {
-        std::cout << json << std::endl;
-        nabtoFree(json);
-    } else {
-        std::cout << "RPC invocation failed with status " << status << std::endl;
-    }
+    const std::string& url = options["rpc-invoke-url"].as<std::string>();
+    std::string result;
+    nabto_status_t status = rpcInvokeUrl(session, host, url, result);
+    prewarmStop();
+    printRpcResult(url, status, result.empty() ? NULL : result.c_str());
     return status == NABTO_OK;
 }
 
@@ -329,14 +1004,15 @@ bool rpcPair(cxxopts::Options& options) {
     nabto_handle_t session;
     char input;
     int deviceChoice = -1;
-    std::string url = "nabto://";
+    RpcUrlBuilder url;
 
     status = nabtoGetLocalDevices(&devices, &devicesLength);
     if (status != NABTO_OK) {
-        std::cout << "Failed to discover local devices" << std::endl;
+        CLI_LOG_ERROR("Failed to discover local devices");
         return false;
     }
 
+    Log::flush();
     while (deviceChoice < 0 || deviceChoice >= devicesLength){
         std::cout << "Choose a device for pairing: " << std::endl;
         std::cout << "[q]: Quit without pairing" << std::endl;
@@ -356,7 +1032,7 @@ bool rpcPair(cxxopts::Options& options) {
     }
 
     if (!certOpenSession(session, options)) {
-        std::cout << "Failed to open session" << std::endl;
+        CLI_LOG_ERROR("Failed to open session");
         for (int i = 0; i < devicesLength; i++) {
             nabtoFree(devices[i]);
         }
@@ -372,20 +1048,21 @@ bool rpcPair(cxxopts::Options& options) {
     }
     if(options.count("strict-interface-check")) {
         if (!checkInterface(session, std::string(devices[deviceChoice]), options)) {
-            std::cout << "ERROR: strict interface check failed" << std::endl;
+            CLI_LOG_ERROR("ERROR: strict interface check failed");
             return false;
         }
     }
     char* json;
-    url.append(devices[deviceChoice]);
-    url.append("/pair_with_device.json?name=");
-    url.append(options["cert-name"].as<std::string>());
-    status = nabtoRpcInvoke(session, url.c_str() , &json);
+    url.reset(devices[deviceChoice], "pair_with_device.json").param("name", options["cert-name"].as<std::string>());
+    {
+        RpcPhaseTimer timer("rpc_invoke", devices[deviceChoice], "pair_with_device.json");
+        status = nabtoRpcInvoke(session, url.c_str() , &json);
+    }
     if (status == NABTO_OK || status == NABTO_FAILED_WITH_JSON_MESSAGE) {
-        std::cout << json << std::endl;
+        printRpcResult(url.str(), status, json);
         nabtoFree(json);
     } else {
-        std::cout << "RPC invocation failed with status " << status << std::endl;
+        printRpcResult(url.str(), status, NULL);
     }
 
     for (int i = 0; i < devicesLength; i++) {
@@ -396,101 +1073,405 @@ bool rpcPair(cxxopts::Options& options) {
 
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// tunnel
+std::mutex iomutex_;
 
-bool tunnelRunFromString(cxxopts::Options& options) {
-    nabto_handle_t session;
+/**
+ * Invoke a URL on a session shared by concurrent callers, preparing
+ * its host on first use and failing fast on open circuit breakers.
+ * sent, if given, is cleared when failing fast.
+ */
+nabto_status_t rpcInvokePrepared(nabto_handle_t session, PreparedHosts& hosts, const std::string& url, std::string& result, bool* sent = 0) {
+    std::string host;
+    if (!extractHostFromUrl(url, host)) {
+        result = "ERROR: bad url " + url;
+        return NABTO_ILLEGAL_PARAMETER;
+    }
+    if (!breakerAllow(host)) {
+        result = "ERROR: circuit breaker for " + host + " is open";
+        if (sent) {
+            *sent = false;
+        }
+        return NABTO_ABORTED;
+    }
+    if (!hosts.prepare(session, host)) {
+        result = "ERROR: could not prepare host " + host;
+        return NABTO_FAILED;
+    }
+    return rpcInvokeUrl(session, host, url, result);
+}
 
+bool rpcBatch(cxxopts::Options& options) {
+    nabto_handle_t session;
     if (!certOpenSession(session, options)) {
         return false;
     }
+    if (!rpcSetInterface(session, options["interface-def"].as<std::string>())) {
+        return false;
+    }
 
-    if (!pskSetKeyIfPresent(session, options["tunnel-device"].as<std::string>(), options)) {
-        die("Could not set PSK");
+    if (!prewarmStart(session, options)) {
+        return false;
     }
 
-    tunnelManager_.reset(new TunnelManager(session));
+    PreparedHosts hosts(options);
 
-    for (auto tunnelStr : options["tunnel"].as<std::vector<std::string> >()) {
-        int localPort, remotePort;
-        std::string remoteHost;
-        size_t first = tunnelStr.find(':');
-        if(first == std::string::npos) {
-            std::cout << "Error: invalid tunnel string: " << tunnelStr << std::endl;
-            return false;;
-        } else if (first == 0 ) {
-            localPort = 0;
-        } else {
-            localPort = std::stoi(std::string(tunnelStr,0,first));
-        }
+    RpcBatch batch([&](const std::string& url, std::string& result, bool& sent) {
+            return rpcInvokePrepared(session, hosts, url, result, &sent);
+        }, options["rpc-concurrency"].as<int>(), options["rpc-device-concurrency"].as<int>());
 
-        size_t second = tunnelStr.find(':',first+1);
-        if(second == std::string::npos) {
-            std::cout << "Error: invalid tunnel string: " << tunnelStr << std::endl;
-            return false;
-        } else {
-            remoteHost = std::string(tunnelStr,first+1,second-first-1);
-            remotePort = std::stoi(std::string(tunnelStr,second+1));
-        }
-        if (!tunnelManager_->open(localPort, options["tunnel-device"].as<std::string>(), remoteHost, remotePort)) {
-            std::cout << "Failed to open tunnel: " << tunnelStr << std::endl;
+    if (options.count("rpc-adaptive")) {
+        int initial = options["rpc-device-concurrency"].as<int>();
+        batch.setAdaptive(initial > 0 ? initial : 1);
+    }
+
+    if (options.count("rpc-cache-query")) {
+        auto queries = options["rpc-cache-query"].as<std::vector<std::string> >();
+        batch.setCache(std::chrono::milliseconds(options["rpc-cache-ttl"].as<int>()),
+                       std::set<std::string>(queries.begin(), queries.end()));
+    }
+
+    std::ifstream file;
+    if (options.count("rpc-batch-file")) {
+        file.open(options["rpc-batch-file"].as<std::string>().c_str());
+        if (!file.good()) {
+            CLI_LOG_ERROR("Could not open RPC batch file " << options["rpc-batch-file"].as<std::string>());
+            nabtoCloseSession(session);
             return false;
         }
     }
-    tunnelManager_->watchStatus();
-    return true;
-}
+    std::istream& input = file.is_open() ? static_cast<std::istream&>(file) : std::cin;
+
+    bool allOk = true;
+    std::string url;
+    while (std::getline(input, url)) {
+        if (url.empty()) {
+            continue;
+        }
+        batch.submit(url, [&, url](nabto_status_t status, const std::string& json) {
+                std::lock_guard<std::mutex> lock(iomutex_);
+                printRpcResult(url, status, json.empty() ? NULL : json.c_str());
+                if (status != NABTO_OK) {
+                    allOk = false;
+                }
+            });
+    }
+    batch.wait();
+    batch.printStats();
+    prewarmStop();
+    nabtoCloseSession(session);
+    return allOk;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// tunnel
+
+// parse <local tcp port>:<remote tcp host>:<remote tcp port>
+bool parseTunnelSpec(const std::string& tunnelStr, int& localPort, std::string& remoteHost, int& remotePort) {
+    size_t first = tunnelStr.find(':');
+    size_t second = first == std::string::npos ? first : tunnelStr.find(':', first+1);
+    if (second == std::string::npos) {
+        CLI_LOG_ERROR("Error: invalid tunnel string: " << tunnelStr);
+        return false;
+    }
+    try {
+        localPort = first == 0 ? 0 : std::stoi(std::string(tunnelStr,0,first));
+        remoteHost = std::string(tunnelStr,first+1,second-first-1);
+        remotePort = std::stoi(std::string(tunnelStr,second+1));
+    } catch (std::exception&) {
+        CLI_LOG_ERROR("Error: invalid tunnel string: " << tunnelStr);
+        return false;
+    }
+    return true;
+}
+
+bool tunnelRunFromString(cxxopts::Options& options) {
+    nabto_handle_t session;
+    const std::string& device = options["tunnel-device"].as<std::string>();
+
+    if (!breakerAllow(device)) {
+        die("Circuit breaker for " + device + " is open, failing fast", EXIT_CIRCUIT_OPEN);
+    }
+
+    if (!certOpenSession(session, options)) {
+        return false;
+    }
+
+    if (!pskSetKeyIfPresent(session, device, options)) {
+        die("Could not set PSK");
+    }
+
+    if (options.count("prewarm")) {
+        if (!options.count("interface-def")) {
+            CLI_LOG_ERROR("prewarm needs an RPC interface definition");
+            return false;
+        }
+        if (!rpcSetInterface(session, options["interface-def"].as<std::string>()) || !prewarmStart(session, options)) {
+            return false;
+        }
+    }
+
+    tunnelManager_.reset(new TunnelManager(session));
+    tunnelManager_->setUpgradeInterval(std::chrono::seconds(options["tunnel-upgrade-interval"].as<int>()));
+
+#ifndef WIN32
+    int eventFd = -1;
+    if (options.count("tunnel-events-fd")) {
+        eventFd = options["tunnel-events-fd"].as<int>();
+    } else if (options.count("tunnel-events-socket")) {
+        eventFd = tunnelEventSocketConnect(options["tunnel-events-socket"].as<std::string>());
+        if (eventFd < 0) {
+            CLI_LOG_ERROR("Could not connect to tunnel event socket " << options["tunnel-events-socket"].as<std::string>());
+            return false;
+        }
+    }
+    if (eventFd >= 0) {
+        // a supervisor going away must not kill the tunnels
+        signal(SIGPIPE, SIG_IGN);
+        tunnelManager_->setEventCallback(tunnelEventFdSink(eventFd));
+    }
+#endif
+
+    int firstId = -1;
+    for (auto tunnelStr : options["tunnel"].as<std::vector<std::string> >()) {
+        int localPort, remotePort, id;
+        std::string remoteHost;
+        if (!parseTunnelSpec(tunnelStr, localPort, remoteHost, remotePort)) {
+            return false;
+        }
+        if (!tunnelManager_->open(localPort, device, remoteHost, remotePort, &id)) {
+            CLI_LOG_ERROR("Failed to open tunnel: " << tunnelStr);
+            return false;
+        }
+        if (firstId < 0) {
+            firstId = id;
+        }
+    }
+    // the breaker outcome is recorded while watching, so transitions are reported meanwhile
+    std::atomic<bool> watching { true };
+    std::thread breakerWait;
+    if (breaker_ && firstId >= 0) {
+        breakerWait = std::thread([&watching, &device, firstId]() {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+                nabto_tunnel_state_t state;
+                do {
+                    state = tunnelManager_->waitConnected(firstId, std::chrono::milliseconds(100));
+                } while (watching && !TunnelManager::isConnected(state) && state != NTCS_CLOSED &&
+                         std::chrono::steady_clock::now() < deadline);
+                // tunnels closed by a shutdown say nothing about the device
+                if (watching && !ShutdownCoordinator::requested()) {
+                    breaker_->record(device, TunnelManager::isConnected(state));
+                }
+            });
+    }
+    int hook = ShutdownCoordinator::addHook([]() {
+            tunnelManager_->drain(ShutdownCoordinator::deadline());
+        });
+    tunnelManager_->watchStatus();
+    ShutdownCoordinator::removeHook(hook);
+    watching = false;
+    if (breakerWait.joinable()) {
+        breakerWait.join();
+    }
+    tunnelManager_->close();
+    prewarmStop();
+    return true;
+}
+
+#ifndef WIN32
+static std::unique_ptr<TunnelBench> tunnelBench_;
+#endif
+
+/**
+ * Open the first tunnel given with -t and drive local TCP clients
+ * against it. RR mode needs an echo service behind the tunnel.
+ */
+bool tunnelBench(cxxopts::Options& options) {
+#ifdef WIN32
+    CLI_LOG_ERROR("tunnel-bench is not supported on Windows");
+    return false;
+#else
+    TunnelBench::Mode mode;
+    if (options["bench-mode"].as<std::string>() == "rr") {
+        mode = TunnelBench::RR;
+    } else if (options["bench-mode"].as<std::string>() == "stream") {
+        mode = TunnelBench::STREAM;
+    } else {
+        CLI_LOG_ERROR("Invalid bench-mode: " << options["bench-mode"].as<std::string>());
+        return false;
+    }
+    if (options["bench-connections"].as<int>() < 1 || options["bench-payload"].as<int>() < 1 ||
+        options["bench-duration"].as<int>() < 1) {
+        CLI_LOG_ERROR("bench-connections, bench-payload and bench-duration must be positive");
+        return false;
+    }
+    int localPort, remotePort, id;
+    std::string remoteHost;
+    std::string device = options["tunnel-device"].as<std::string>();
+    if (!parseTunnelSpec(options["tunnel"].as<std::vector<std::string> >()[0], localPort, remoteHost, remotePort)) {
+        return false;
+    }
+
+    nabto_handle_t session;
+    if (!certOpenSession(session, options)) {
+        return false;
+    }
+    if (!pskSetKeyIfPresent(session, device, options)) {
+        die("Could not set PSK");
+    }
+    tunnelManager_.reset(new TunnelManager(session));
+    if (!tunnelManager_->open(localPort, device, remoteHost, remotePort, &id)) {
+        return false;
+    }
+    nabto_tunnel_state_t state = tunnelManager_->waitConnected(id, std::chrono::seconds(30));
+    if (!TunnelManager::isConnected(state)) {
+        CLI_LOG_ERROR("Tunnel did not connect, state " << tunnelStateStr(state));
+        return false;
+    }
+    uint16_t port = tunnelManager_->list()[0].localPort;
+    CLI_LOG_INFO("Tunnel connected over " << tunnelStateStr(state) << ", local TCP port: " << port);
+
+    // a tunnel closing under a writing client must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    tunnelBench_.reset(new TunnelBench(port, mode,
+                                       options["bench-connections"].as<int>(),
+                                       options["bench-payload"].as<int>(),
+                                       std::chrono::seconds(options["bench-duration"].as<int>())));
+    int hook = ShutdownCoordinator::addHook([]() {
+            tunnelBench_->stop();
+        });
+    tunnelBench_->run();
+    ShutdownCoordinator::removeHook(hook);
+
+    // the connection type may have changed during the run
+    nabto_tunnel_state_t endState = tunnelManager_->waitConnected(id, std::chrono::milliseconds(0));
+    std::string connection = tunnelStateStr(state);
+    if (endState != state) {
+        connection += std::string(" -> ") + tunnelStateStr(endState);
+    }
+    tunnelBench_->printResults(connection.c_str());
+    tunnelManager_->close();
+    nabtoCloseSession(session);
+    return true;
+#endif
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // stream
 
-std::mutex iomutex_;
+// how often a blocked stream read checks for shutdown
+static const int STREAM_READ_TIMEOUT_MS = 250;
+static std::atomic<bool> streamStop_ { false };
 
-bool streamReadFunc(nabto_handle_t session, cxxopts::Options& options) {
+// open a stream to host on session, read and dump all received data
+bool streamReadDevice(nabto_handle_t session, const std::string& device) {
     nabto_stream_t stream;
     char* response;
     size_t actual = 0; /* actual size (in bytes) of response */
     nabto_status_t status;
 
-    if (!certOpenSession(session, options)) {
-        return false;
-    }
-    const char* host(options["tunnel-device"].as<std::string>().c_str());
+    const char* host = device.c_str();
     status = nabtoStreamOpen(&stream, session, host);
+    int hook = -1;
     if (status == NABTO_OK) {
+        FlightRecorder::record(FlightRecorder::EVENT_STREAM_OPEN, status, 0, host);
+        // reads time out so the loop below sees streamStop_, the stream is only closed here
+        int timeout = STREAM_READ_TIMEOUT_MS;
+        nabtoStreamSetOption(stream, NABTO_STREAM_OPTION_RCVTIMEO, &timeout, sizeof(timeout));
+        hook = ShutdownCoordinator::addHook([]() {
+                streamStop_ = true;
+            });
         std::lock_guard<std::mutex> lock(iomutex_);
-        std::cout << "nabtoStreamOpen() succeeded, stream = " << stream <<  std::endl;
-
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("stream_open");
+            event["stream"] = Output::handle(stream);
+            event["device"] = host;
+            Output::emit(event);
+        } else {
+            CLI_LOG_INFO("nabtoStreamOpen() succeeded, stream = " << stream);
+        }
     } else {
         std::lock_guard<std::mutex> lock(iomutex_);
-        std::cout << "nabtoStreamOpen() failed with status " << status << ": " << nabtoStatusStr(status) << std::endl;
-        nabtoCloseSession(session);
+        FlightRecorder::record(FlightRecorder::EVENT_ERROR, status, 0, host, nabtoStatusStr(status));
+        CLI_LOG_ERROR("nabtoStreamOpen() failed with status " << status << ": " << nabtoStatusStr(status));
         return false;
     }
 
+    auto start = std::chrono::steady_clock::now();
+    size_t reads = 0;
+    size_t bytes = 0;
+    bool stopped = false;
     while (true) {
         status = nabtoStreamRead(stream, &response, &actual);
-        std::cout << "got " << actual << " bytes with status " << status << std::endl;
+        if (streamStop_) {
+            stopped = true;
+            break;
+        }
+        if (status == NABTO_OK && actual == 0) {
+            // read timeout
+            continue;
+        }
+        if (Output::ndjson()) {
+            if (status != NABTO_OK) {
+                break;
+            }
+            reads++;
+            bytes += actual;
+            Json::Value event = Output::event("stream_data");
+            event["stream"] = Output::handle(stream);
+            event["bytes"] = (Json::UInt64)actual;
+            event["data_hex"] = Hex::encode((const unsigned char*)response, actual);
+            Output::emit(event);
+            continue;
+        }
+        CLI_LOG_DEBUG("got " << actual << " bytes with status " << status);
         if (status == NABTO_OK) {
-            std::string responseStr(response, actual);
-            std::cout << responseStr << std::endl;
+            reads++;
+            bytes += actual;
+            Output::results().write(response, actual) << '\n';
         } else {
             break;
         }
     }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    ShutdownCoordinator::removeHook(hook);
+    nabtoStreamClose(stream);
+    if (stopped) {
+        status = NABTO_STREAM_CLOSED;
+    }
+    FlightRecorder::record(FlightRecorder::EVENT_STREAM_CLOSED, status, bytes, host, nabtoStatusStr(status));
 
     std::lock_guard<std::mutex> lock(iomutex_);
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("stream_closed");
+        event["stream"] = Output::handle(stream);
+        event["status"] = status;
+        event["clean"] = status == NABTO_STREAM_CLOSED;
+        event["reads"] = (Json::UInt64)reads;
+        event["bytes"] = (Json::UInt64)bytes;
+        event["duration_ms"] = (Json::Int64)elapsed.count();
+        Output::emit(event);
+        return status == NABTO_STREAM_CLOSED;
+    }
+    CLI_LOG_INFO("Stream " << stream << " received " << bytes << " bytes in " << reads << " reads in " << elapsed.count() << " ms");
     if (status == NABTO_STREAM_CLOSED) {
-        std::cout << "Stream " << stream << " closed cleanly" << std::endl;
+        CLI_LOG_INFO("Stream " << stream << " closed cleanly");
         return true;
     } else {
-        std::cout << "Stream read failed with status " << nabtoStatusStr(status) << std::endl;
+        CLI_LOG_ERROR("Stream read failed with status " << nabtoStatusStr(status));
         return false;
     }
 
 }
 
+bool streamReadFunc(nabto_handle_t session, cxxopts::Options& options) {
+    if (!certOpenSession(session, options)) {
+        return false;
+    }
+    bool ok = streamReadDevice(session, options["tunnel-device"].as<std::string>());
+    nabtoCloseSession(session);
+    return ok;
+}
+
 bool streamRead(cxxopts::Options& options) {
     nabto_handle_t session;
     return streamReadFunc(session, options);
@@ -520,7 +1501,13 @@ bool showLocalDevices() {
     }
 
     for(int i = 0; i < devicesLength; i++) {
-        std::cout << devices[i] << std::endl;
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("device");
+            event["id"] = devices[i];
+            Output::emit(event);
+        } else {
+            Output::results() << devices[i] << std::endl;
+        }
     }
 
     for (int i = 0; i < devicesLength; i++) {
@@ -533,11 +1520,473 @@ bool showLocalDevices() {
 bool showVersion() {
     char* version;
     nabto_status_t status = nabtoVersionString(&version);
-    std::cout << version << std::endl;
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("version");
+        event["version"] = version;
+        Output::emit(event);
+    } else {
+        Output::results() << version << std::endl;
+    }
     nabtoFree(version);
     return status == NABTO_OK;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// shell
+
+static const size_t SHELL_HISTORY_SIZE = 1000;
+
+struct ShellState {
+    ShellState(cxxopts::Options& options)
+        : session(nullptr), options(options), hosts(options), quit(false) {}
+    nabto_handle_t session;
+    cxxopts::Options& options;
+    PreparedHosts hosts;
+    std::vector<std::string> history;
+    std::string historyFile;
+    bool quit;
+};
+
+void shellHelp() {
+    Output::results() << "Commands:" << std::endl
+                      << "  invoke <url>                        invoke RPC query on the open session" << std::endl
+                      << "  interface <file>                    load RPC interface definition" << std::endl
+                      << "  tunnel open <spec> [device]         open tunnel, spec is <local port>:<remote host>:<remote port>" << std::endl
+                      << "  tunnel close <id>                   close tunnel" << std::endl
+                      << "  tunnel list                         list open tunnels" << std::endl
+                      << "  stream <device>                     open stream to device, read and dump all received data" << std::endl
+                      << "  discover                            show devices on local network" << std::endl
+                      << "  certs                               show available certificates" << std::endl
+                      << "  history                             show command history, !n reruns command n and !! the last" << std::endl
+                      << "  quit                                close tunnels and session and exit" << std::endl;
+}
+
+bool shellInvoke(ShellState& state, const std::string& url) {
+    std::string host;
+    if (!extractHostFromUrl(url, host)) {
+        Output::results() << "ERROR: bad url" << std::endl;
+        return false;
+    }
+    if (!state.hosts.prepare(state.session, host)) {
+        return false;
+    }
+    std::string result;
+    nabto_status_t status = rpcInvokeUrl(state.session, host, url, result);
+    printRpcResult(url, status, result.empty() ? NULL : result.c_str());
+    return status == NABTO_OK;
+}
+
+bool shellTunnel(ShellState& state, const std::vector<std::string>& args) {
+    if (args.size() >= 3 && args[1] == "open") {
+        std::string device;
+        if (args.size() >= 4) {
+            device = args[3];
+        } else if (state.options.count("tunnel-device")) {
+            device = state.options["tunnel-device"].as<std::string>();
+        } else {
+            Output::results() << "No device given and no default tunnel-device" << std::endl;
+            return false;
+        }
+        int localPort, remotePort;
+        std::string remoteHost;
+        if (!parseTunnelSpec(args[2], localPort, remoteHost, remotePort)) {
+            return false;
+        }
+        if (!state.hosts.prepare(state.session, device)) {
+            return false;
+        }
+        int id;
+        if (!tunnelManager_->open(localPort, device, remoteHost, remotePort, &id)) {
+            Output::results() << "Failed to open tunnel: " << args[2] << std::endl;
+            return false;
+        }
+        Output::results() << "Opened tunnel " << id << std::endl;
+        return true;
+    }
+    if (args.size() == 3 && args[1] == "close") {
+        int id;
+        try {
+            id = std::stoi(args[2]);
+        } catch (std::exception&) {
+            Output::results() << "Invalid tunnel id: " << args[2] << std::endl;
+            return false;
+        }
+        if (!tunnelManager_->close(id)) {
+            Output::results() << "No tunnel with id " << id << std::endl;
+            return false;
+        }
+        return true;
+    }
+    if (args.size() == 2 && args[1] == "list") {
+        for (auto& t : tunnelManager_->list()) {
+            if (Output::ndjson()) {
+                Json::Value event = Output::event("tunnel");
+                event["id"] = t.id;
+                event["device"] = t.deviceId;
+                event["local_port"] = t.localPort;
+                event["remote_host"] = t.remoteHost;
+                event["remote_port"] = t.remotePort;
+                event["state"] = tunnelStateStr(t.state);
+                Output::emit(event);
+            } else {
+                Output::results() << t.id << " " << t.localPort << ":" << t.remoteHost << ":" << t.remotePort
+                                  << " " << t.deviceId << " " << tunnelStateStr(t.state) << std::endl;
+            }
+        }
+        return true;
+    }
+    Output::results() << "Usage: tunnel open <spec> [device] | tunnel close <id> | tunnel list" << std::endl;
+    return false;
+}
+
+bool shellExecute(ShellState& state, const std::vector<std::string>& args) {
+    const std::string& cmd = args[0];
+    if (cmd == "help") {
+        shellHelp();
+        return true;
+    } else if (cmd == "quit" || cmd == "exit") {
+        state.quit = true;
+        return true;
+    } else if (cmd == "invoke" && args.size() == 2) {
+        return shellInvoke(state, args[1]);
+    } else if (cmd == "interface" && args.size() == 2) {
+        return rpcSetInterface(state.session, args[1]);
+    } else if (cmd == "tunnel") {
+        return shellTunnel(state, args);
+    } else if (cmd == "stream" && args.size() == 2) {
+        return state.hosts.prepare(state.session, args[1]) && streamReadDevice(state.session, args[1]);
+    } else if (cmd == "discover" && args.size() == 1) {
+        return showLocalDevices();
+    } else if (cmd == "certs" && args.size() == 1) {
+        return certList(state.options, "");
+    } else if (cmd == "history" && args.size() == 1) {
+        for (size_t i = 0; i < state.history.size(); i++) {
+            Output::results() << (i + 1) << "  " << state.history[i] << std::endl;
+        }
+        return true;
+    }
+    Output::results() << "Unknown command or wrong arguments: " << cmd << ", try help" << std::endl;
+    return false;
+}
+
+// expand !! and !<n> from history, false if no such entry
+bool shellExpandHistory(ShellState& state, std::string& line) {
+    if (line.empty() || line[0] != '!') {
+        return true;
+    }
+    size_t n;
+    if (line == "!!") {
+        n = state.history.size();
+    } else {
+        try {
+            n = std::stoul(line.substr(1));
+        } catch (std::exception&) {
+            n = 0;
+        }
+    }
+    if (n == 0 || n > state.history.size()) {
+        Output::results() << line << ": event not found" << std::endl;
+        return false;
+    }
+    line = state.history[n - 1];
+    Output::results() << line << std::endl;
+    return true;
+}
+
+void shellAddHistory(ShellState& state, const std::string& line) {
+    if (!state.history.empty() && state.history.back() == line) {
+        return;
+    }
+    state.history.push_back(line);
+    if (state.history.size() > SHELL_HISTORY_SIZE) {
+        state.history.erase(state.history.begin());
+    }
+    std::ofstream ofs(state.historyFile.c_str(), std::ofstream::app);
+    ofs << line << std::endl;
+}
+
+void shellLoadHistory(ShellState& state) {
+    std::ifstream ifs(state.historyFile.c_str());
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (!line.empty()) {
+            state.history.push_back(line);
+        }
+    }
+    if (state.history.size() > SHELL_HISTORY_SIZE) {
+        state.history.erase(state.history.begin(), state.history.end() - SHELL_HISTORY_SIZE);
+        // keep the file from growing without bounds
+        std::ofstream ofs(state.historyFile.c_str(), std::ofstream::trunc);
+        for (auto& l : state.history) {
+            ofs << l << std::endl;
+        }
+    }
+}
+
+bool shellRun(cxxopts::Options& options) {
+    ShellState state(options);
+    state.historyFile = nabtoHomeDir(options) + "/nabto-cli-history";
+    if (!certOpenSession(state.session, options)) {
+        return false;
+    }
+    if (options.count("interface-def") && !rpcSetInterface(state.session, options["interface-def"].as<std::string>())) {
+        nabtoCloseSession(state.session);
+        return false;
+    }
+    shellLoadHistory(state);
+
+    tunnelManager_.reset(new TunnelManager(state.session));
+    tunnelManager_->setUpgradeInterval(std::chrono::seconds(options["tunnel-upgrade-interval"].as<int>()));
+    std::thread watcher([]() { tunnelManager_->watchStatus(false); });
+
+    std::string line;
+    while (!state.quit) {
+        Log::flush();
+        std::cout << "nabto> " << std::flush;
+        if (!std::getline(std::cin, line)) {
+            std::cout << std::endl;
+            break;
+        }
+        std::istringstream iss(line);
+        std::vector<std::string> args((std::istream_iterator<std::string>(iss)), std::istream_iterator<std::string>());
+        if (args.empty()) {
+            continue;
+        }
+        line = args[0];
+        for (size_t i = 1; i < args.size(); i++) {
+            line += " " + args[i];
+        }
+        if (!shellExpandHistory(state, line)) {
+            continue;
+        }
+        shellAddHistory(state, line);
+        iss.clear();
+        iss.str(line);
+        args.assign(std::istream_iterator<std::string>(iss), std::istream_iterator<std::string>());
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = shellExecute(state, args);
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("shell_command");
+            event["command"] = line;
+            event["ok"] = ok;
+            event["duration_ms"] = us / 1000.0;
+            Output::emit(event);
+        } else if (!state.quit) {
+            Log::flush();
+            std::cout << (ok ? "" : "failed ") << "(" << us / 1000.0 << " ms)" << std::endl;
+        }
+    }
+
+    tunnelManager_->stop();
+    watcher.join();
+    tunnelManager_->close();
+    nabtoCloseSession(state.session);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// scenario
+
+static const std::chrono::seconds SCENARIO_TUNNEL_TIMEOUT(30);
+static std::unique_ptr<Scenario> scenario_;
+
+struct ScenarioSession {
+    ScenarioSession(cxxopts::Options& options) : session(nullptr), hosts(options) {}
+    nabto_handle_t session;
+    PreparedHosts hosts;
+    std::unique_ptr<TunnelManager> tunnels;
+};
+
+bool scenarioOperation(ScenarioSession& s, const ScenarioOperation& op) {
+    if (op.type == ScenarioOperation::RPC) {
+        std::string host;
+        if (!extractHostFromUrl(op.url, host) || !s.hosts.prepare(s.session, host)) {
+            return false;
+        }
+        std::string result;
+        return rpcInvokeUrl(s.session, host, op.url, result) == NABTO_OK;
+    }
+    int localPort, remotePort, id;
+    std::string remoteHost;
+    if (!parseTunnelSpec(op.tunnel, localPort, remoteHost, remotePort) ||
+        !s.hosts.prepare(s.session, op.device) ||
+        !s.tunnels->open(localPort, op.device, remoteHost, remotePort, &id)) {
+        return false;
+    }
+    nabto_tunnel_state_t state = s.tunnels->waitConnected(id, SCENARIO_TUNNEL_TIMEOUT);
+    bool ok = TunnelManager::isConnected(state);
+    if (ok) {
+        std::this_thread::sleep_for(op.hold);
+    }
+    s.tunnels->close(id);
+    return ok;
+}
+
+bool scenarioRun(cxxopts::Options& options) {
+    std::string error;
+    scenario_.reset(new Scenario());
+    if (!scenario_->load(options["scenario"].as<std::string>(), error)) {
+        CLI_LOG_ERROR(error);
+        return false;
+    }
+    for (auto& op : scenario_->operations()) {
+        int localPort, remotePort;
+        std::string remoteHost;
+        if (op.type == ScenarioOperation::RPC && !options.count("interface-def")) {
+            CLI_LOG_ERROR("Missing RPC interface definition for scenario RPC operations");
+            return false;
+        }
+        if (op.type == ScenarioOperation::TUNNEL && !parseTunnelSpec(op.tunnel, localPort, remoteHost, remotePort)) {
+            return false;
+        }
+    }
+
+    std::vector<std::unique_ptr<ScenarioSession> > sessions;
+    for (size_t i = 0; i < scenario_->sessions(); i++) {
+        std::unique_ptr<ScenarioSession> s(new ScenarioSession(options));
+        if (!certOpenSession(s->session, options)) {
+            return false;
+        }
+        if (options.count("interface-def") && !rpcSetInterface(s->session, options["interface-def"].as<std::string>())) {
+            return false;
+        }
+        s->tunnels.reset(new TunnelManager(s->session));
+        sessions.push_back(std::move(s));
+    }
+
+    int hook = ShutdownCoordinator::addHook([]() {
+            scenario_->stop();
+        });
+    scenario_->run([&](const ScenarioOperation& op, uint64_t seq) {
+            return scenarioOperation(*sessions[seq % sessions.size()], op);
+        });
+    ShutdownCoordinator::removeHook(hook);
+
+    for (auto& s : sessions) {
+        nabtoCloseSession(s->session);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// poll
+
+static std::unique_ptr<Poller> poller_;
+
+bool pollRun(cxxopts::Options& options) {
+    poller_.reset(new Poller(options["poll-concurrency"].as<int>(),
+                             std::chrono::seconds(options["poll-report-interval"].as<int>())));
+    std::string error;
+    if (options.count("poll-file") && !poller_->load(options["poll-file"].as<std::string>(), error)) {
+        CLI_LOG_ERROR("Invalid poll file: " << error);
+        return false;
+    }
+    if (options.count("poll")) {
+        for (auto& spec : options["poll"].as<std::vector<std::string> >()) {
+            PollJob job;
+            if (!Poller::parseJob(spec, job, error) || !poller_->add(job, error)) {
+                CLI_LOG_ERROR("Invalid poll: " << error);
+                return false;
+            }
+        }
+    }
+    std::unique_ptr<ChangeFilter> changes;
+    if (options.count("rpc-watch")) {
+        for (auto& url : options["rpc-watch"].as<std::vector<std::string> >()) {
+            PollJob job;
+            job.url = url;
+            job.interval = std::chrono::milliseconds(options["interval"].as<int>());
+            job.changesOnly = true;
+            if (!poller_->add(job, error)) {
+                CLI_LOG_ERROR("Invalid watch: " << error);
+                return false;
+            }
+        }
+        changes.reset(new ChangeFilter(std::chrono::seconds(options["heartbeat"].as<int>())));
+        poller_->reportSuppressed();
+    }
+    if (poller_->size() == 0) {
+        CLI_LOG_ERROR("Nothing to poll");
+        return false;
+    }
+
+    nabto_handle_t session;
+    if (!certOpenSession(session, options)) {
+        return false;
+    }
+    if (!rpcSetInterface(session, options["interface-def"].as<std::string>()) || !prewarmStart(session, options)) {
+        return false;
+    }
+    PreparedHosts hosts(options);
+
+    int hook = ShutdownCoordinator::addHook([]() {
+            poller_->stop();
+        });
+    CLI_LOG_INFO("Polling " << poller_->size() << " URLs");
+    poller_->run([&](const PollJob& job, bool& suppressed) {
+            std::string result;
+            nabto_status_t status = rpcInvokePrepared(session, hosts, job.url, result);
+            if (job.changesOnly && !changes->update(job.url, status, result)) {
+                suppressed = true;
+                return status == NABTO_OK;
+            }
+            std::lock_guard<std::mutex> lock(iomutex_);
+            printRpcResult(job.url, status, result.empty() ? NULL : result.c_str());
+            return status == NABTO_OK;
+        });
+    ShutdownCoordinator::removeHook(hook);
+    prewarmStop();
+    nabtoCloseSession(session);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// result log
+
+bool resultLogQuery(cxxopts::Options& options) {
+    std::string device;
+    if (options.count("result-log-device")) {
+        device = options["result-log-device"].as<std::string>();
+    }
+    int64_t from = options.count("result-log-from") ? (int64_t)(options["result-log-from"].as<double>() * 1e6) : INT64_MIN;
+    int64_t to = options.count("result-log-to") ? (int64_t)(options["result-log-to"].as<double>() * 1e6) : INT64_MAX;
+    size_t count = 0;
+    std::string error;
+    bool ok = ResultLogReader::query(options["result-log-query"].as<std::string>(), device, from, to,
+                                     [&](const ResultRecord& r) {
+            count++;
+            std::string body(r.body, r.bodyLength);
+            if (Output::ndjson()) {
+                Json::Value event = Output::event("result_log_record");
+                event["time_us"] = (Json::Int64)r.timestampUs;
+                event["device"] = std::string(r.device, r.deviceLength);
+                event["query"] = std::string(r.query, r.queryLength);
+                event["status"] = r.status;
+                event["latency_us"] = r.latencyUs;
+                if (!body.empty()) {
+                    event["result"] = Output::sdkJson(body.c_str());
+                }
+                Output::emit(event);
+                return;
+            }
+            Output::results() << r.timestampUs / 1000000 << "." << std::setw(6) << std::setfill('0') << r.timestampUs % 1000000
+                              << std::setfill(' ') << " " << std::string(r.device, r.deviceLength) << " "
+                              << std::string(r.query, r.queryLength) << " status " << r.status << " latency "
+                              << r.latencyUs / 1000.0 << " ms" << std::endl;
+            if (!body.empty()) {
+                Output::results() << body << std::endl;
+            }
+        }, error);
+    if (!ok) {
+        CLI_LOG_ERROR("Could not read result log: " << error);
+        return false;
+    }
+    CLI_LOG_INFO(count << " records");
+    return true;
+}
+
 } // namespace
 
 using namespace nabtocli;
@@ -548,52 +1997,135 @@ using namespace nabtocli;
 int main(int argc, char** argv) {
     try
     {
+        commandLine_.assign(argv, argv + argc);
         cxxopts::Options options(argv[0], "Nabto Command Line demo");
 
         options.add_options()
             ("c,create-cert", "Create self signed certificate")
+            ("create-certs-from", "Create self signed certificates for each line of <name>[,<password>] in file, using one worker process per core, and print a CSV manifest", cxxopts::value<std::string>())
+            ("cert-batch-shard", "Internal: run as worker <index>/<count> of --create-certs-from", cxxopts::value<std::string>())
             ("n,cert-name", "Certificate name. ex.: nabto-user", cxxopts::value<std::string>())
             ("a,password", "Password for encrypting private key", cxxopts::value<std::string>()->default_value("not-so-secret"))
             ("bs-auth-json", "JSON doc to pass to basestation for authentication. ex.: {\"key\": \"secretKey\"}", cxxopts::value<std::string>())
             ("local-connection-psk-id", "16 byte hex encoded PSK id to use for PSK on local psk connection (32 hex xhars)", cxxopts::value<std::string>())
             ("local-connection-psk", "16 byte hex encoded PSK to use for local psk connection (32 hex chars)", cxxopts::value<std::string>())
+            ("local-connection-psk-file", "File with a \"<device id> <psk id> <psk>\" line per device to use for local psk connections", cxxopts::value<std::string>())
             ("q,rpc-invoke-url", "URL for RPC query. ex.: nabto://device.nabto.com/get_public_device_info.json?", cxxopts::value<std::string>())
+            ("rpc-batch", "Read RPC URLs from stdin (one per line) and invoke them concurrently over one session, identical in-flight URLs share one invocation")
+            ("rpc-batch-file", "Read RPC URLs for rpc-batch mode from this file instead of stdin", cxxopts::value<std::string>())
+            ("rpc-concurrency", "Max number of concurrent RPC invocations in rpc-batch mode", cxxopts::value<int>()->default_value("4"))
+            ("rpc-device-concurrency", "Max number of concurrent RPC invocations per device in rpc-batch mode, 0 for no limit", cxxopts::value<int>()->default_value("0"))
+            ("rpc-adaptive", "Adapt the number of concurrent RPC invocations per device in rpc-batch mode to observed latency and errors, starting at rpc-device-concurrency")
+            ("prewarm", "Connect to these devices in parallel at startup of rpc and tunnel commands and keep the connections alive, comma separated or @file with one device per line", cxxopts::value<std::string>())
+            ("prewarm-query", "Cheap RPC query used to connect to and keep alive prewarmed devices", cxxopts::value<std::string>()->default_value("get_public_device_info.json"))
+            ("prewarm-keepalive", "Seconds between keepalive RPCs to prewarmed devices, 0 to disable", cxxopts::value<int>()->default_value("30"))
+            ("rpc-cache-ttl", "Milliseconds to cache responses to queries given with rpc-cache-query in rpc-batch mode", cxxopts::value<int>()->default_value("1000"))
+            ("rpc-cache-query", "Idempotent query to cache responses for in rpc-batch mode, can be repeated. ex.: get_public_device_info.json", cxxopts::value<std::vector<std::string>>())
+            ("rpc-timing", "Record latency histograms of RPC phases per device and query, dumped as JSON at exit and on SIGUSR1")
+            ("rpc-timing-file", "Write rpc-timing histograms to this file instead of stderr", cxxopts::value<std::string>())
             ("i,interface-def", "Path to unabto_queries.xml file with RPC interface definition. ex.: /path/to/unabto_queries.xml", cxxopts::value<std::string>())
             ("strict-interface-check", "Use strict interface check for all RPC calls")
             ("interface-id", "interface ID to match for strict interface check. ex.: 317aadf2-3137-474b-8ddb-fea437c424f4", cxxopts::value<std::string>())
             ("interface-version", "<major>.<minor> version number to match for strict interface check. ex.: 1.0", cxxopts::value<std::string>())
             ("d,tunnel-device", "Nabto device ID for tunnel (and more), e.g. device.nabto.com", cxxopts::value<std::string>())
             ("t,tunnel", "Tunnel specification, can be repeated to open multiple tunnel. Format: <local tcp port>:<remote tcp host>:<remote tcp port>", cxxopts::value<std::vector<std::string>>())
+            ("tunnel-upgrade-interval", "Seconds between attempts to move idle relayed tunnels to a P2P connection, 0 disables", cxxopts::value<int>()->default_value("0"))
+            ("tunnel-events-fd", "Write tunnel state transitions as NDJSON to this already open file descriptor", cxxopts::value<int>())
+            ("tunnel-events-socket", "Write tunnel state transitions as NDJSON to this unix domain socket", cxxopts::value<std::string>())
+            ("poll", "Invoke this RPC URL repeatedly until interrupted, can be repeated. Format: <url>@<interval>, interval in ms, s (default), m or h", cxxopts::value<std::vector<std::string>>())
+            ("poll-file", "Poll the <url>@<interval> lines of this file", cxxopts::value<std::string>())
+            ("poll-concurrency", "Max number of concurrent RPC invocations when polling", cxxopts::value<int>()->default_value("16"))
+            ("poll-report-interval", "Seconds between poll reports of rate, errors and schedule lag", cxxopts::value<int>()->default_value("10"))
+            ("rpc-watch", "Invoke this RPC URL every interval until interrupted and only print results that changed, can be repeated", cxxopts::value<std::vector<std::string>>())
+            ("interval", "Milliseconds between invocations of rpc-watch URLs", cxxopts::value<int>()->default_value("1000"))
+            ("heartbeat", "Seconds after which an unchanged rpc-watch result is printed again, 0 for never", cxxopts::value<int>()->default_value("60"))
+            ("result-log", "Append every RPC result to a segmented binary log in this directory", cxxopts::value<std::string>())
+            ("result-log-segment-mb", "Size in MB at which result log segments are rotated", cxxopts::value<int>()->default_value("64"))
+            ("result-log-query", "Print the results in the result log in this directory, optionally filtered by device and time", cxxopts::value<std::string>())
+            ("result-log-device", "Only print result-log-query results of this device", cxxopts::value<std::string>())
+            ("result-log-from", "Only print result-log-query results at or after this unix time in seconds", cxxopts::value<double>())
+            ("result-log-to", "Only print result-log-query results at or before this unix time in seconds", cxxopts::value<double>())
+            ("scenario", "Load test with the open loop mix of RPC and tunnel operations described in this JSON file, see README", cxxopts::value<std::string>())
+            ("shell", "Interactive shell running RPC, tunnel and stream commands over one session, type help for commands")
+            ("tunnel-bench", "Open the tunnel given with -t and -d, drive local TCP clients against it and report goodput and latency")
+            ("bench-mode", "tunnel-bench traffic pattern, rr (request/response, needs an echo service behind the tunnel) or stream (bulk writes)", cxxopts::value<std::string>()->default_value("rr"))
+            ("bench-connections", "Number of parallel tunnel-bench TCP connections", cxxopts::value<int>()->default_value("4"))
+            ("bench-payload", "Bytes per tunnel-bench request or write", cxxopts::value<int>()->default_value("1024"))
+            ("bench-duration", "Seconds to run tunnel-bench", cxxopts::value<int>()->default_value("10"))
             ("stream-read", "Open stream to device specified with -d, read and dump all received data")
             ("H,home-dir", "Override default Nabto home directory. ex.: /path/to/dir", cxxopts::value<std::string>())
             ("pair", "pair user to a local device")
             ("discover", "Show Nabto devices ids discovered on local network")
             ("certs", "Show available certificates")
+            ("cert-by-fingerprint", "Show certificates with the given fingerprint, with or without colons", cxxopts::value<std::string>())
+            ("output", "Output format, text or ndjson (one compact JSON object per event on stdout, other text on stderr)", cxxopts::value<std::string>()->default_value("text"))
+            ("shutdown-timeout", "Milliseconds to wait for open tunnel connections to drain on SIGINT/SIGTERM", cxxopts::value<int>()->default_value("5000"))
+            ("log-level", "Minimum level of status messages, trace, debug, info, warn or error", cxxopts::value<std::string>()->default_value("info"))
+            ("log-timestamps", "Prefix status messages with seconds since start and level")
+            ("trace", "Write a Chrome trace event JSON file of startup, RPC and tunnel phases at exit, for chrome://tracing or Perfetto", cxxopts::value<std::string>())
+            ("flight-recorder-file", "File to dump recent tunnel, RPC, stream and error events to on SIGUSR2 and fatal signals, default is nabto-cli-flight-recorder.<pid>.log in the home dir", cxxopts::value<std::string>())
+            ("circuit-breaker", "Fail fast with exit code 75 on devices that repeatedly could not be reached, state is shared by all invocations through nabto-cli-breakers in the home dir")
+            ("breaker-threshold", "Consecutive failures to reach a device that open its circuit breaker", cxxopts::value<int>()->default_value("3"))
+            ("breaker-probe-interval", "Seconds before a call is let through to probe a device with an open circuit breaker", cxxopts::value<int>()->default_value("30"))
+            ("startup-profile", "Print time spent in each SDK initialisation phase")
             ("v,version", "Show version")
             ("h,help", "Show help");
 
         options.parse(argc, argv);
 
-        if (!init(options)) {
-            die("Initialization failed");
+        if (options["output"].as<std::string>() == "ndjson") {
+            Output::setNdjson();
+        } else if (options["output"].as<std::string>() != "text") {
+            die("Invalid output format: " + options["output"].as<std::string>());
+        }
+
+        LogLevel logLevel;
+        if (!Log::parseLevel(options["log-level"].as<std::string>(), logLevel)) {
+            die("Invalid log level: " + options["log-level"].as<std::string>());
+        }
+        Log::setLevel(logLevel);
+        if (options.count("log-timestamps")) {
+            Log::setTimestamps(true);
+        }
+
+        if (options.count("trace")) {
+            Trace::enable(options["trace"].as<std::string>());
+        }
+
+        if (options.count("rpc-timing")) {
+            timingEnable(options);
+        }
+
+        if (options.count("result-log") && options["result-log-segment-mb"].as<int>() < 1) {
+            die("result-log-segment-mb must be at least 1");
         }
 
         ////////////////////////////////////////////////////////////////////////////////
         // show stuff
 
+        if (options.count("help")) {
+            help(options);
+            exit(0);
+        }
+
         if (options.count("discover")) {
+            initOrDie(options, false);
             showLocalDevices();
             exit(0);
         }
 
         if (options.count("version")) {
+            initOrDie(options, false);
             showVersion();
             exit(0);
         }
 
-        if (options.count("help")) {
-            help(options);
-            die("", 0);
+        if (options.count("result-log-query")) {
+            if (resultLogQuery(options)) {
+                exit(0);
+            } else {
+                die("Result log query failed");
+            }
         }
 
         ////////////////////////////////////////////////////////////////////////////////
@@ -603,6 +2135,7 @@ int main(int argc, char** argv) {
             if (!options.count("cert-name")) {
                 die("Missing cert-name parameter");
             }
+            initOrDie(options, true);
             if (certCreate(options["cert-name"].as<std::string>(), options["password"].as<std::string>())) {
                 exit(0);
             } else {
@@ -610,14 +2143,40 @@ int main(int argc, char** argv) {
             }
         }
 
+        if (options.count("create-certs-from")) {
+            initOrDie(options, true);
+            std::string shard = options.count("cert-batch-shard") ? options["cert-batch-shard"].as<std::string>() : "";
+            if (certCreateBatch(options["create-certs-from"].as<std::string>(), options["password"].as<std::string>(), shard)) {
+                exit(0);
+            } else {
+                die("Create certs failed");
+            }
+        }
+
         if(options.count("certs")) {
-            if (certList()) {
+            initOrDie(options, false);
+            if (certList(options, "")) {
                 exit(0);
             } else {
                 die("list certs failed");
             }
         }
 
+        if (options.count("cert-by-fingerprint")) {
+            const std::string& fingerprint = options["cert-by-fingerprint"].as<std::string>();
+            std::vector<char> bytes;
+            std::string error;
+            if (!Hex::decode(fingerprint, 16, bytes, error)) {
+                die("Invalid fingerprint \"" + fingerprint + "\": " + error);
+            }
+            initOrDie(options, false);
+            if (certList(options, normalizeFingerprint(fingerprint))) {
+                exit(0);
+            } else {
+                die("No certificate with fingerprint " + options["cert-by-fingerprint"].as<std::string>());
+            }
+        }
+
         if (options.count("local-connection-psk-id") && !options.count("local-connection-psk")) {
             die("missing local-connection-psk option");
         }
@@ -626,6 +2185,14 @@ int main(int argc, char** argv) {
             die("missing local-connection-psk-id option");
         }
 
+        if (options.count("local-connection-psk-file")) {
+            std::string error;
+            pskKeyring_.reset(new PskKeyring());
+            if (!pskKeyring_->load(options["local-connection-psk-file"].as<std::string>(), error)) {
+                die(error);
+            }
+        }
+
         ////////////////////////////////////////////////////////////////////////////////
         // rpc
 
@@ -636,10 +2203,10 @@ int main(int argc, char** argv) {
             if (!options.count("cert-name")) {
                 die("Missing cert-name parameter");
             }
+            initOrDie(options, true);
             if (rpcInvoke(options)) {
                 if (!options.count("tunnel")) {
-                    nabtoShutdown();
-                    exit(0);
+                    shutdown(0);
                 } else {
                     // next, start any tunnels
                 }
@@ -648,6 +2215,27 @@ int main(int argc, char** argv) {
             }
         }
 
+        if (options.count("rpc-batch") || options.count("rpc-batch-file")) {
+            if (!options.count("interface-def")) {
+                die("Missing RPC interface definition");
+            }
+            if (!options.count("cert-name")) {
+                die("Missing cert-name parameter");
+            }
+            if (options["rpc-concurrency"].as<int>() < 1) {
+                die("rpc-concurrency must be at least 1");
+            }
+            if (options["rpc-device-concurrency"].as<int>() < 0) {
+                die("rpc-device-concurrency must not be negative");
+            }
+            initOrDie(options, true);
+            if (rpcBatch(options)) {
+                shutdown(0);
+            } else {
+                die("RPC batch failed");
+            }
+        }
+
         if (options.count("pair")) {
             if (!options.count("cert-name")) {
                 die("Missing cert-name parameter");
@@ -655,9 +2243,9 @@ int main(int argc, char** argv) {
             if (!options.count("interface-def")) {
                 die("Missing RPC interface definition");
             }
+            initOrDie(options, true);
             if (rpcPair(options)) {
-                nabtoShutdown();
-                exit(0);
+                shutdown(0);
             } else {
                 die("Pairing failed");
             }
@@ -666,6 +2254,24 @@ int main(int argc, char** argv) {
         ////////////////////////////////////////////////////////////////////////////////
         // tunnel
 
+        if (options.count("tunnel-bench")) {
+            if (!options.count("cert-name")) {
+                die("Missing cert-name parameter");
+            }
+            if (!options.count("tunnel-device")) {
+                die("Missing tunnel-device parameter");
+            }
+            if (!options.count("tunnel")) {
+                die("Missing tunnel parameter");
+            }
+            initOrDie(options, true);
+            if (tunnelBench(options)) {
+                shutdown(0);
+            } else {
+                die("Tunnel bench failed");
+            }
+        }
+
         if (options.count("tunnel")) {
             if (!options.count("cert-name")) {
                 die("Missing cert-name parameter");
@@ -673,9 +2279,9 @@ int main(int argc, char** argv) {
             if (!options.count("tunnel-device")) {
                 die("Missing tunnel-device parameter");
             }
+            initOrDie(options, true);
             if (tunnelRunFromString(options)) {
-                nabtoShutdown();
-                exit(0);
+                shutdown(0);
             } else {
                 die("Could not start tunnel");
             }
@@ -691,14 +2297,68 @@ int main(int argc, char** argv) {
             if (!options.count("tunnel-device")) {
                 die("Missing tunnel-device parameter");
             }
+            initOrDie(options, true);
             if (streamRead(options)) {
-                nabtoShutdown();
-                exit(0);
+                shutdown(0);
             } else {
                 die("Could not start stream read");
             }
         }
 
+        ////////////////////////////////////////////////////////////////////////////////
+        // poll
+
+        if (options.count("poll") || options.count("poll-file") || options.count("rpc-watch")) {
+            if (!options.count("interface-def")) {
+                die("Missing RPC interface definition");
+            }
+            if (!options.count("cert-name")) {
+                die("Missing cert-name parameter");
+            }
+            if (options["poll-concurrency"].as<int>() < 1 || options["poll-report-interval"].as<int>() < 1) {
+                die("poll-concurrency and poll-report-interval must be at least 1");
+            }
+            if (options["interval"].as<int>() < 10 || options["heartbeat"].as<int>() < 0) {
+                die("interval must be at least 10 ms and heartbeat must not be negative");
+            }
+            initOrDie(options, true);
+            if (pollRun(options)) {
+                shutdown(0);
+            } else {
+                die("Polling failed");
+            }
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // scenario
+
+        if (options.count("scenario")) {
+            if (!options.count("cert-name")) {
+                die("Missing cert-name parameter");
+            }
+            initOrDie(options, true);
+            if (scenarioRun(options)) {
+                shutdown(0);
+            } else {
+                die("Scenario failed");
+            }
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // shell
+
+        if (options.count("shell")) {
+            if (!options.count("cert-name")) {
+                die("Missing cert-name parameter");
+            }
+            initOrDie(options, true);
+            if (shellRun(options)) {
+                shutdown(0);
+            } else {
+                die("Could not start shell");
+            }
+        }
+
 
         help(options);
 
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "output.hpp"
+#include "json_helper.hpp"
+#include "log.hpp"
+
+#include <iostream>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <cstdio>
+
+
+namespace nabtocli {
+
+/**
+ * Stream buffer appending to a preallocated string, such that a
+ * serialised line can be written with one call.
+ */
+class LineBuffer : public std::streambuf {
+public:
+    std::string line;
+    LineBuffer() {
+        line.reserve(64 * 1024);
+    }
+protected:
+    int_type overflow(int_type c) {
+        if (c != traits_type::eof()) {
+            line.push_back((char)c);
+        }
+        return c;
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) {
+        line.append(s, (size_t)n);
+        return n;
+    }
+};
+
+NdjsonSerializer::NdjsonSerializer()
+    : buffer_(new LineBuffer()), stream_(new std::ostream(buffer_.get())) {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    writer_.reset(builder.newStreamWriter());
+}
+
+NdjsonSerializer::~NdjsonSerializer() {
+}
+
+const std::string& NdjsonSerializer::serialize(const Json::Value& doc) {
+    std::string& line = buffer_->line;
+    line.clear();
+    writer_->write(doc, stream_.get());
+    line.push_back('\n');
+    return line;
+}
+
+class NdjsonWriter {
+public:
+    std::mutex mutex;
+    NdjsonSerializer serializer;
+};
+
+static NdjsonWriter* ndjsonWriter_ = 0;
+
+void Output::setNdjson() {
+    if (ndjsonWriter_) {
+        return;
+    }
+    // never destroyed, events may be emitted from atexit handlers
+    ndjsonWriter_ = new NdjsonWriter();
+    std::cout.flush();
+    std::cout.rdbuf(std::cerr.rdbuf());
+}
+
+bool Output::ndjson() {
+    return ndjsonWriter_ != 0;
+}
+
+Json::Value Output::event(const char* name) {
+    Json::Value doc;
+    doc["event"] = name;
+    doc["ts"] = (Json::Int64)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    return doc;
+}
+
+void Output::emit(const Json::Value& event) {
+    if (!ndjsonWriter_) {
+        results() << nabto::JsonHelper::toString(event) << std::endl;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ndjsonWriter_->mutex);
+    const std::string& line = ndjsonWriter_->serializer.serialize(event);
+    fwrite(line.data(), 1, line.size(), stdout);
+    fflush(stdout);
+}
+
+std::ostream& Output::results() {
+    Log::flush();
+    return std::cout;
+}
+
+std::string Output::handle(const void* handle) {
+    std::ostringstream ss;
+    ss << handle;
+    return ss.str();
+}
+
+Json::Value Output::sdkJson(const char* json) {
+    Json::Value doc;
+    if (json && nabto::JsonHelper::parse(std::string(json), doc)) {
+        return doc;
+    }
+    return Json::Value(json ? json : "");
+}
+
+} // namespace
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <json/json.h>
+
+#include <string>
+#include <memory>
+
+
+namespace nabtocli {
+
+class LineBuffer;
+
+/**
+ * Serialises JSON values to single compact lines using a reusable
+ * writer and a preallocated buffer. Not thread safe.
+ */
+class NdjsonSerializer {
+private:
+    std::unique_ptr<LineBuffer> buffer_;
+    std::unique_ptr<std::ostream> stream_;
+    std::unique_ptr<Json::StreamWriter> writer_;
+public:
+    NdjsonSerializer();
+    ~NdjsonSerializer();
+    // returned line ends with a newline and is valid until the next call
+    const std::string& serialize(const Json::Value& doc);
+};
+
+/**
+ * Machine readable output. In NDJSON mode every event is written to
+ * stdout as one compact JSON object per line, and human readable text
+ * written to std::cout is moved to stderr so stdout stays parseable.
+ */
+class Output {
+public:
+    static void setNdjson();
+    static bool ndjson();
+    // create an event object with "event" and "ts" (unix time in ms) set
+    static Json::Value event(const char* name);
+    // write event as a single line with a single write
+    static void emit(const Json::Value& event);
+    // std::cout for human readable results, after waiting for log lines
+    // queued before the call to be written
+    static std::ostream& results();
+    // printable id of an SDK handle, e.g. a tunnel or stream
+    static std::string handle(const void* handle);
+    // parse a JSON document returned by the SDK, falls back to a string value
+    static Json::Value sdkJson(const char* json);
+};
+
+} // namespace
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "poller.hpp"
+#include "timing_wheel.hpp"
+#include "worker_pool.hpp"
+#include "output.hpp"
+
+#include <memory>
+#include <random>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+
+namespace nabtocli {
+
+static const std::chrono::milliseconds TICK(10);
+
+const size_t Poller::MAX_JOBS;
+
+Poller::Poller(size_t concurrency, std::chrono::seconds reportInterval)
+    : concurrency_(concurrency), reportInterval_(reportInterval) {
+}
+
+bool Poller::parseJob(const std::string& spec, PollJob& job, std::string& error) {
+    size_t at = spec.rfind('@');
+    if (at == std::string::npos || at == 0) {
+        error = "expected <url>@<interval>: " + spec;
+        return false;
+    }
+    std::string interval(spec, at + 1);
+    size_t unit = interval.find_first_not_of("0123456789");
+    std::string suffix = unit == std::string::npos ? "s" : interval.substr(unit);
+    long long value;
+    try {
+        value = std::stoll(interval.substr(0, unit));
+    } catch (std::exception&) {
+        error = "invalid interval: " + spec;
+        return false;
+    }
+    if (suffix == "ms") {
+        job.interval = std::chrono::milliseconds(value);
+    } else if (suffix == "s") {
+        job.interval = std::chrono::seconds(value);
+    } else if (suffix == "m") {
+        job.interval = std::chrono::minutes(value);
+    } else if (suffix == "h") {
+        job.interval = std::chrono::hours(value);
+    } else {
+        error = "invalid interval unit: " + spec;
+        return false;
+    }
+    if (job.interval < TICK) {
+        error = "interval must be at least 10ms: " + spec;
+        return false;
+    }
+    job.url = spec.substr(0, at);
+    return true;
+}
+
+bool Poller::load(const std::string& file, std::string& error) {
+    std::ifstream ifs(file.c_str());
+    if (!ifs.good()) {
+        error = "could not open " + file;
+        return false;
+    }
+    std::string line;
+    while (std::getline(ifs, line)) {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        PollJob job;
+        if (!parseJob(line, job, error) || !add(job, error)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Poller::add(const PollJob& job, std::string& error) {
+    if (jobs_.size() >= MAX_JOBS) {
+        error = "too many poll jobs, at most " + std::to_string(MAX_JOBS);
+        return false;
+    }
+    jobs_.push_back(job);
+    return true;
+}
+
+void Poller::stop() {
+    stop_ = true;
+}
+
+void Poller::run(Executor executor) {
+    size_t count = jobs_.size();
+    std::unique_ptr<std::atomic<bool>[]> busy(new std::atomic<bool>[count]);
+    std::vector<uint64_t> due(count);
+    std::vector<uint64_t> period(count);
+    std::mt19937_64 rng(std::random_device{}());
+    TimingWheel wheel;
+    for (size_t i = 0; i < count; i++) {
+        busy[i] = false;
+        period[i] = jobs_[i].interval / TICK;
+        due[i] = 1 + std::uniform_int_distribution<uint64_t>(0, period[i] - 1)(rng);
+        wheel.schedule(i, due[i]);
+    }
+
+    WorkerPool pool(concurrency_);
+    Clock::time_point start = Clock::now();
+    Clock::time_point lastReport = start;
+    std::vector<uint32_t> expired;
+
+    while (!stop_) {
+        Clock::time_point nextReport = lastReport + reportInterval_;
+        std::this_thread::sleep_until(std::min(start + TICK * (int64_t)(wheel.tick() + 1), nextReport));
+        Clock::time_point now = Clock::now();
+        if (now >= nextReport) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            report("poll_report", interval_, now - start, now - lastReport);
+            lastReport = now;
+        }
+        uint64_t tick = (now - start) / TICK;
+        expired.clear();
+        wheel.advance(tick, expired);
+        for (uint32_t id : expired) {
+            if (busy[id].exchange(true)) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                interval_.skipped++;
+            } else {
+                inFlight_++;
+                Clock::time_point scheduled = start + TICK * (int64_t)due[id];
+                pool.post([this, id, scheduled, &executor, &busy]() {
+                        Clock::time_point begin = Clock::now();
+                        bool suppressed = false;
+                        bool ok = executor(jobs_[id], suppressed);
+                        Clock::time_point end = Clock::now();
+                        {
+                            std::lock_guard<std::mutex> lock(mutex_);
+                            interval_.lag.record(std::chrono::duration_cast<std::chrono::microseconds>(begin - scheduled).count());
+                            interval_.latency.record(std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count());
+                            if (!ok) {
+                                interval_.errors++;
+                            }
+                            if (suppressed) {
+                                interval_.suppressed++;
+                            }
+                        }
+                        inFlight_--;
+                        busy[id] = false;
+                    });
+            }
+            // fixed rate, rounds missed while the loop was stalled are dropped
+            due[id] = std::max(due[id] + period[id], tick + 1);
+            wheel.schedule(id, due[id]);
+        }
+    }
+    pool.wait();
+
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    report("poll_report", interval_, now - start, now - lastReport);
+    report("poll_summary", total_, now - start, now - start);
+}
+
+// prints and resets stats, folding interval stats into the totals
+void Poller::report(const char* event, Stats& stats, Clock::duration elapsed, Clock::duration interval) {
+    double seconds = std::chrono::duration<double>(interval).count();
+    double elapsedSeconds = std::chrono::duration<double>(elapsed).count();
+    uint64_t polls = stats.latency.count();
+    double rate = seconds > 0 ? polls / seconds : 0;
+    double suppression = polls ? (double)stats.suppressed / polls : 0;
+    if (Output::ndjson()) {
+        Json::Value doc = Output::event(event);
+        doc["elapsed_s"] = elapsedSeconds;
+        doc["interval_s"] = seconds;
+        doc["jobs"] = (Json::UInt64)jobs_.size();
+        doc["in_flight"] = (Json::UInt64)inFlight_;
+        doc["polls"] = (Json::UInt64)polls;
+        doc["rate"] = rate;
+        doc["errors"] = (Json::UInt64)stats.errors;
+        doc["skipped"] = (Json::UInt64)stats.skipped;
+        if (reportSuppressed_) {
+            doc["suppressed"] = (Json::UInt64)stats.suppressed;
+            doc["suppression_ratio"] = suppression;
+        }
+        doc["lag"] = stats.lag.toJson("us");
+        doc["latency"] = stats.latency.toJson("us");
+        Output::emit(doc);
+    } else {
+        std::ostream& out = Output::results();
+        out << std::fixed << std::setprecision(1)
+            << (&stats == &total_ ? "Poll summary" : "Poll report") << " at " << elapsedSeconds << " s: "
+            << polls << " polls (" << rate << "/s), " << stats.errors << " errors, " << stats.skipped << " skipped, ";
+        if (reportSuppressed_) {
+            out << stats.suppressed << " unchanged (" << 100 * suppression << "% suppressed), ";
+        }
+        out << inFlight_ << " in flight, schedule lag p50 " << stats.lag.percentile(50) / 1000.0
+            << " ms, p99 " << stats.lag.percentile(99) / 1000.0 << " ms, max " << stats.lag.max() / 1000.0
+            << " ms, latency p50 " << stats.latency.percentile(50) / 1000.0
+            << " ms, p99 " << stats.latency.percentile(99) / 1000.0 << " ms" << std::endl
+            << std::defaultfloat << std::setprecision(6);
+    }
+    if (&stats != &total_) {
+        total_.lag.merge(stats.lag);
+        total_.latency.merge(stats.latency);
+        total_.errors += stats.errors;
+        total_.skipped += stats.skipped;
+        total_.suppressed += stats.suppressed;
+        stats = Stats();
+    }
+}
+
+} // namespace
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "histogram.hpp"
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <functional>
+
+
+namespace nabtocli {
+
+struct PollJob {
+    std::string url;
+    std::chrono::milliseconds interval;
+    // only emit results that changed, see ChangeFilter
+    bool changesOnly = false;
+};
+
+/**
+ * Invokes RPC URLs at fixed intervals on a worker pool until stopped.
+ * Jobs are kept on a hierarchical timing wheel with 10 ms ticks, and
+ * the first run of each job is spread randomly over its interval so
+ * jobs with the same interval do not fire together. A job that is still
+ * running when it is due again is skipped for that round. Schedule lag,
+ * the time from when a poll was due until a worker started it, is
+ * reported with the RPC latency at a fixed interval.
+ *
+ * The executor may suppress a result it did not emit, e.g. because it
+ * did not change; suppressed results are counted in the reports.
+ */
+class Poller {
+public:
+    // returns false on failure, sets suppressed if the result was not emitted
+    typedef std::function<bool(const PollJob& job, bool& suppressed)> Executor;
+
+    static const size_t MAX_JOBS = 100000;
+
+    Poller(size_t concurrency, std::chrono::seconds reportInterval);
+    // <url>@<interval>, the interval in ms, s (default), m or h, e.g. 500ms or 5s
+    static bool parseJob(const std::string& spec, PollJob& job, std::string& error);
+    // one job per line, lines starting with # are ignored
+    bool load(const std::string& file, std::string& error);
+    bool add(const PollJob& job, std::string& error);
+    size_t size() const { return jobs_.size(); }
+    // include suppressed results and the suppression ratio in reports
+    void reportSuppressed() { reportSuppressed_ = true; }
+    // blocks until stop
+    void run(Executor executor);
+    void stop();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Stats {
+        Histogram lag;
+        Histogram latency;
+        uint64_t errors = 0;
+        uint64_t skipped = 0;
+        uint64_t suppressed = 0;
+    };
+
+    void report(const char* event, Stats& stats, Clock::duration elapsed, Clock::duration interval);
+
+    size_t concurrency_;
+    std::chrono::seconds reportInterval_;
+    bool reportSuppressed_ = false;
+    std::vector<PollJob> jobs_;
+    std::mutex mutex_;
+    Stats interval_;
+    Stats total_;
+    std::atomic<size_t> inFlight_ { 0 };
+    std::atomic<bool> stop_ { false };
+};
+
+} // namespace
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "prewarm.hpp"
+#include "worker_pool.hpp"
+#include "output.hpp"
+#include "log.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+
+namespace nabtocli {
+
+static const size_t MAX_PARALLEL = 16;
+
+Prewarmer::Prewarmer(Ping ping, std::chrono::seconds keepalive)
+    : ping_(ping), interval_(keepalive) {
+}
+
+Prewarmer::~Prewarmer() {
+    stop();
+}
+
+bool Prewarmer::parseDevices(const std::string& spec, std::vector<std::string>& devices) {
+    std::ifstream file;
+    std::istringstream list;
+    std::istream* in = &list;
+    char separator = ',';
+    if (!spec.empty() && spec[0] == '@') {
+        file.open(spec.substr(1).c_str());
+        if (!file.good()) {
+            return false;
+        }
+        in = &file;
+        separator = '\n';
+    } else {
+        list.str(spec);
+    }
+    std::string device;
+    while (std::getline(*in, device, separator)) {
+        device.erase(0, device.find_first_not_of(" \t\r"));
+        device.erase(device.find_last_not_of(" \t\r") + 1);
+        if (!device.empty() && device[0] != '#' &&
+            std::find(devices.begin(), devices.end(), device) == devices.end()) {
+            devices.push_back(device);
+        }
+    }
+    return !devices.empty();
+}
+
+void Prewarmer::warm(const std::vector<std::string>& devices) {
+    typedef std::chrono::steady_clock Clock;
+    struct Result {
+        nabto_status_t status;
+        double ms;
+    };
+    std::vector<Result> results(devices.size());
+    Clock::time_point start = Clock::now();
+    {
+        WorkerPool pool(std::min(devices.size(), MAX_PARALLEL));
+        for (size_t i = 0; i < devices.size(); i++) {
+            pool.post([this, &devices, &results, i] {
+                    Clock::time_point begin = Clock::now();
+                    results[i].status = ping_(devices[i]);
+                    results[i].ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+                });
+        }
+        pool.wait();
+    }
+    double total = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    size_t warmed = 0;
+    for (size_t i = 0; i < devices.size(); i++) {
+        // a JSON error response still means the connection is up
+        bool ok = results[i].status == NABTO_OK || results[i].status == NABTO_FAILED_WITH_JSON_MESSAGE;
+        if (ok) {
+            warmed++;
+        }
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("prewarm");
+            event["device"] = devices[i];
+            event["ok"] = ok;
+            event["ms"] = results[i].ms;
+            if (!ok) {
+                event["status"] = nabtoStatusStr(results[i].status);
+            }
+            Output::emit(event);
+        } else if (ok) {
+            CLI_LOG_INFO("Prewarmed " << devices[i] << " in " << results[i].ms << " ms");
+        } else {
+            CLI_LOG_WARN("Prewarming " << devices[i] << " failed after " << results[i].ms << " ms: "
+                         << nabtoStatusStr(results[i].status));
+        }
+    }
+    CLI_LOG_INFO("Prewarmed " << warmed << " of " << devices.size() << " devices in " << total << " ms");
+
+    if (interval_.count() > 0 && !thread_.joinable()) {
+        devices_ = devices;
+        thread_ = std::thread(&Prewarmer::keepalive, this);
+    }
+}
+
+void Prewarmer::keepalive() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cond_.wait_for(lock, interval_, [this] { return stop_.load(); })) {
+        lock.unlock();
+        for (auto& device : devices_) {
+            if (stop_) {
+                break;
+            }
+            nabto_status_t status = ping_(device);
+            if (status != NABTO_OK && status != NABTO_FAILED_WITH_JSON_MESSAGE) {
+                CLI_LOG_DEBUG("Keepalive of " << device << " failed: " << nabtoStatusStr(status));
+            }
+        }
+        lock.lock();
+    }
+}
+
+void Prewarmer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+} // namespace
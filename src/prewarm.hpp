@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "nabto_client_api.h"
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+
+namespace nabtocli {
+
+/**
+ * Sets up connections to a list of devices in parallel before they are
+ * used, by invoking a cheap RPC on each, and keeps them alive with the
+ * same RPC at a fixed interval until stopped.
+ */
+class Prewarmer {
+public:
+    // one cheap invocation on the device over the shared session
+    typedef std::function<nabto_status_t(const std::string& device)> Ping;
+
+    Prewarmer(Ping ping, std::chrono::seconds keepalive);
+    ~Prewarmer();
+    // warm all devices, returns when each has answered or failed
+    void warm(const std::vector<std::string>& devices);
+    void stop();
+
+    // comma separated devices, or @file with one device per line
+    static bool parseDevices(const std::string& spec, std::vector<std::string>& devices);
+
+private:
+    void keepalive();
+
+    Ping ping_;
+    std::chrono::seconds interval_;
+    std::vector<std::string> devices_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::atomic<bool> stop_ { false };
+    std::thread thread_;
+};
+
+} // namespace
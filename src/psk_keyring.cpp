@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "psk_keyring.hpp"
+#include "hex.hpp"
+
+#include <fstream>
+#include <sstream>
+
+
+namespace nabtocli {
+
+static const size_t PSK_LENGTH = 16;
+
+bool PskKeyring::load(const std::string& file, std::string& error) {
+    std::ifstream ifs(file.c_str(), std::ifstream::in);
+    if (!ifs.good()) {
+        error = "Failed to open PSK file: " + file;
+        return false;
+    }
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(ifs, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream ls(line);
+        std::string host, keyId, key;
+        if (!(ls >> host)) {
+            // whitespace only
+            continue;
+        }
+        std::string hexError;
+        Psk psk;
+        if (!(ls >> keyId >> key) ||
+            !Hex::decode(keyId, PSK_LENGTH, psk.keyId, hexError) ||
+            !Hex::decode(key, PSK_LENGTH, psk.key, hexError))
+        {
+            error = "Invalid PSK line " + std::to_string(lineNumber) + " in " + file;
+            if (!hexError.empty()) {
+                error += ": " + hexError;
+            }
+            return false;
+        }
+        keys_[host] = psk;
+    }
+    return true;
+}
+
+bool PskKeyring::contains(const std::string& host) const {
+    return keys_.find(host) != keys_.end();
+}
+
+bool PskKeyring::apply(nabto_handle_t session, const std::string& host) {
+    auto it = keys_.find(host);
+    if (it == keys_.end()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = std::make_pair(session, host);
+    if (applied_.count(key)) {
+        return true;
+    }
+    if (nabtoSetLocalConnectionPsk(session, host.c_str(), it->second.keyId.data(), it->second.key.data()) != NABTO_OK) {
+        return false;
+    }
+    applied_.insert(key);
+    return true;
+}
+
+} // namespace
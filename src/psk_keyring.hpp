@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "nabto_client_api.h"
+
+#include <set>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <utility>
+#include <unordered_map>
+
+
+namespace nabtocli {
+
+/**
+ * Local connection PSKs for many devices, loaded from a file with one
+ * "<device id> <key id> <key>" line per device (16 byte hex keys, plain
+ * or colon separated). Keys are set on a session the first time the
+ * device is contacted.
+ */
+class PskKeyring {
+public:
+    bool load(const std::string& file, std::string& error);
+    bool contains(const std::string& host) const;
+    // set the PSK for host on session unless already done
+    bool apply(nabto_handle_t session, const std::string& host);
+    size_t size() const { return keys_.size(); }
+private:
+    struct Psk {
+        std::vector<char> keyId;
+        std::vector<char> key;
+    };
+    std::unordered_map<std::string, Psk> keys_;
+    std::mutex mutex_;
+    std::set<std::pair<nabto_handle_t, std::string> > applied_;
+};
+
+} // namespace
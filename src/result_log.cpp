@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "result_log.hpp"
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+
+namespace nabtocli {
+
+static const char LOG_MAGIC[8] = { 'N', 'C', 'L', 'I', 'R', 'L', 'G', '1' };
+static const char INDEX_MAGIC[8] = { 'N', 'C', 'L', 'I', 'R', 'I', 'X', '1' };
+static const uint64_t INDEX_INTERVAL = 64 * 1024;
+static const size_t WRITE_BUFFER = 1024 * 1024;
+static const std::chrono::seconds FLUSH_INTERVAL(1);
+
+// follows the uint32_t length prefix, which counts the header and the fields
+struct RecordHeader {
+    int64_t timestampUs;
+    uint32_t latencyUs;
+    int32_t status;
+    uint16_t deviceLength;
+    uint16_t queryLength;
+    uint32_t bodyLength;
+};
+
+struct IndexEntry {
+    int64_t timestampUs;
+    uint64_t offset;
+};
+
+static std::string segmentName(const std::string& dir, uint64_t seq, const char* extension) {
+    char name[32];
+    snprintf(name, sizeof(name), "results-%016llu.%s", (unsigned long long)seq, extension);
+    return dir + "/" + name;
+}
+
+#ifndef WIN32
+
+// sequence numbers of the segments in dir, in increasing order
+static bool listSegments(const std::string& dir, std::vector<uint64_t>& segments) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return false;
+    }
+    while (struct dirent* entry = readdir(d)) {
+        unsigned long long seq;
+        char extension[4];
+        if (sscanf(entry->d_name, "results-%16llu.%3s", &seq, extension) == 2 && strcmp(extension, "log") == 0) {
+            segments.push_back(seq);
+        }
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+    return true;
+}
+
+ResultLog::ResultLog(const std::string& dir, uint64_t segmentBytes)
+    : dir_(dir), segmentBytes_(segmentBytes) {
+}
+
+ResultLog::~ResultLog() {
+    close();
+}
+
+bool ResultLog::open(std::string& error) {
+    mkdir(dir_.c_str(), 0755);
+    std::vector<uint64_t> segments;
+    if (!listSegments(dir_, segments)) {
+        error = "cannot read directory " + dir_;
+        return false;
+    }
+    seq_ = segments.empty() ? 0 : segments.back();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!openSegment()) {
+        error = "cannot create segment in " + dir_;
+        return false;
+    }
+    return true;
+}
+
+// called with mutex_ held
+bool ResultLog::openSegment() {
+    // O_EXCL so concurrent processes never share a segment
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < 100; attempt++) {
+        seq_++;
+        fd = ::open(segmentName(dir_, seq_, "log").c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    if (fd < 0) {
+        return false;
+    }
+    log_ = fdopen(fd, "wb");
+    index_ = fopen(segmentName(dir_, seq_, "idx").c_str(), "wb");
+    if (!log_ || !index_) {
+        closeSegment();
+        return false;
+    }
+    setvbuf(log_, 0, _IOFBF, WRITE_BUFFER);
+    fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), log_);
+    fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC), index_);
+    offset_ = sizeof(LOG_MAGIC);
+    indexed_ = 0;
+    return true;
+}
+
+void ResultLog::closeSegment() {
+    if (log_) {
+        fclose(log_);
+        log_ = 0;
+    }
+    if (index_) {
+        fclose(index_);
+        index_ = 0;
+    }
+}
+
+void ResultLog::append(const std::string& device, const std::string& query, int32_t status,
+                       uint32_t latencyUs, const std::string& body) {
+    RecordHeader header;
+    header.latencyUs = latencyUs;
+    header.status = status;
+    header.deviceLength = (uint16_t)std::min<size_t>(device.size(), UINT16_MAX);
+    header.queryLength = (uint16_t)std::min<size_t>(query.size(), UINT16_MAX);
+    header.bodyLength = (uint32_t)std::min<size_t>(body.size(), UINT32_MAX - UINT16_MAX * 2 - sizeof(header));
+    uint32_t length = sizeof(header) + header.deviceLength + header.queryLength + header.bodyLength;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!log_) {
+        return;
+    }
+    if (offset_ > sizeof(LOG_MAGIC) && offset_ + sizeof(length) + length > segmentBytes_) {
+        closeSegment();
+        if (!openSegment()) {
+            return;
+        }
+    }
+    // stamped under the lock and clamped so timestamps never decrease within a segment
+    int64_t clockUs = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    header.timestampUs = std::max(clockUs, lastTimestampUs_);
+    lastTimestampUs_ = header.timestampUs;
+    if (indexed_ == 0 || offset_ - indexed_ >= INDEX_INTERVAL) {
+        IndexEntry entry = { header.timestampUs, offset_ };
+        fwrite(&entry, sizeof(entry), 1, index_);
+        fflush(index_);
+        indexed_ = offset_;
+    }
+    fwrite(&length, sizeof(length), 1, log_);
+    fwrite(&header, sizeof(header), 1, log_);
+    fwrite(device.data(), 1, header.deviceLength, log_);
+    fwrite(query.data(), 1, header.queryLength, log_);
+    fwrite(body.data(), 1, header.bodyLength, log_);
+    offset_ += sizeof(length) + length;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now - flushed_ >= FLUSH_INTERVAL) {
+        fflush(log_);
+        flushed_ = now;
+    }
+}
+
+void ResultLog::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closeSegment();
+}
+
+/**
+ * Read only mapping of a whole file.
+ */
+class MappedFile {
+public:
+    MappedFile() : data_(0), size_(0) {}
+    ~MappedFile() {
+        if (data_) {
+            munmap(data_, size_);
+        }
+    }
+    bool open(const std::string& file) {
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            size_ = st.st_size;
+            void* data = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = data != MAP_FAILED;
+            data_ = ok ? data : 0;
+        }
+        ::close(fd);
+        return ok;
+    }
+    const char* data() const { return static_cast<const char*>(data_); }
+    size_t size() const { return data_ ? size_ : 0; }
+private:
+    void* data_;
+    size_t size_;
+};
+
+/**
+ * Offset of the last indexed record before fromUs, where the scan of a
+ * segment starts. Returns false if the segment starts after toUs.
+ */
+static bool indexStart(const std::string& file, int64_t fromUs, int64_t toUs, uint64_t& offset) {
+    offset = sizeof(LOG_MAGIC);
+    MappedFile index;
+    if (!index.open(file) || index.size() < sizeof(INDEX_MAGIC) ||
+        memcmp(index.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+        // no usable index, scan the whole segment
+        return true;
+    }
+    size_t count = (index.size() - sizeof(INDEX_MAGIC)) / sizeof(IndexEntry);
+    std::vector<IndexEntry> entries(count);
+    memcpy(entries.data(), index.data() + sizeof(INDEX_MAGIC), count * sizeof(IndexEntry));
+    if (count > 0 && entries[0].timestampUs > toUs) {
+        return false;
+    }
+    auto it = std::lower_bound(entries.begin(), entries.end(), fromUs,
+                               [](const IndexEntry& e, int64_t t) { return e.timestampUs < t; });
+    if (it != entries.begin()) {
+        offset = (it - 1)->offset;
+    }
+    return true;
+}
+
+bool ResultLogReader::query(const std::string& dir, const std::string& device, int64_t fromUs, int64_t toUs,
+                            Callback callback, std::string& error) {
+    std::vector<uint64_t> segments;
+    if (!listSegments(dir, segments)) {
+        error = "cannot read directory " + dir;
+        return false;
+    }
+    for (uint64_t seq : segments) {
+        uint64_t offset;
+        if (!indexStart(segmentName(dir, seq, "idx"), fromUs, toUs, offset)) {
+            continue;
+        }
+        MappedFile segment;
+        if (!segment.open(segmentName(dir, seq, "log"))) {
+            error = "cannot open segment " + segmentName(dir, seq, "log");
+            return false;
+        }
+        const char* data = segment.data();
+        size_t size = segment.size();
+        if (size < sizeof(LOG_MAGIC) || memcmp(data, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+            continue;
+        }
+        while (offset + sizeof(uint32_t) + sizeof(RecordHeader) <= size) {
+            uint32_t length;
+            RecordHeader header;
+            memcpy(&length, data + offset, sizeof(length));
+            memcpy(&header, data + offset + sizeof(length), sizeof(header));
+            if (length < sizeof(header) || offset + sizeof(length) + length > size) {
+                // partially written tail
+                break;
+            }
+            if (header.timestampUs > toUs) {
+                break;
+            }
+            const char* fields = data + offset + sizeof(length) + sizeof(header);
+            offset += sizeof(length) + length;
+            if (header.timestampUs < fromUs) {
+                continue;
+            }
+            if (!device.empty() && (header.deviceLength != device.size() ||
+                                    memcmp(fields, device.data(), device.size()) != 0)) {
+                continue;
+            }
+            ResultRecord record;
+            record.timestampUs = header.timestampUs;
+            record.latencyUs = header.latencyUs;
+            record.status = header.status;
+            record.device = fields;
+            record.deviceLength = header.deviceLength;
+            record.query = fields + header.deviceLength;
+            record.queryLength = header.queryLength;
+            record.body = record.query + header.queryLength;
+            record.bodyLength = header.bodyLength;
+            callback(record);
+        }
+    }
+    return true;
+}
+
+#else
+
+ResultLog::ResultLog(const std::string& dir, uint64_t segmentBytes)
+    : dir_(dir), segmentBytes_(segmentBytes) {
+}
+
+ResultLog::~ResultLog() {
+}
+
+bool ResultLog::open(std::string& error) {
+    error = "result logs are not supported on Windows";
+    return false;
+}
+
+void ResultLog::append(const std::string& device, const std::string& query, int32_t status,
+                       uint32_t latencyUs, const std::string& body) {
+}
+
+void ResultLog::close() {
+}
+
+bool ResultLogReader::query(const std::string& dir, const std::string& device, int64_t fromUs, int64_t toUs,
+                            Callback callback, std::string& error) {
+    error = "result logs are not supported on Windows";
+    return false;
+}
+
+#endif
+
+} // namespace
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+
+
+namespace nabtocli {
+
+/**
+ * Append only binary log of RPC results in a directory of segments,
+ * results-<seq>.log, each with a sparse time index results-<seq>.idx.
+ * A record is a length prefixed header (timestamp, latency, status and
+ * field lengths, host byte order) followed by device, query and body.
+ * An index entry (timestamp, offset) is written for the first record of
+ * a segment and then about every 64 KB. A segment is closed at the size
+ * limit and every process writes to new segments. Timestamps are
+ * clamped to the previous one if the system clock steps back, so they
+ * are non-decreasing within a segment, which the reader relies on.
+ */
+class ResultLog {
+public:
+    ResultLog(const std::string& dir, uint64_t segmentBytes);
+    ~ResultLog();
+    bool open(std::string& error);
+    // thread safe, the record is timestamped here
+    void append(const std::string& device, const std::string& query, int32_t status,
+                uint32_t latencyUs, const std::string& body);
+    void close();
+
+private:
+    bool openSegment();
+    void closeSegment();
+
+    std::string dir_;
+    uint64_t segmentBytes_;
+    std::mutex mutex_;
+    uint64_t seq_ = 0;
+    FILE* log_ = 0;
+    FILE* index_ = 0;
+    uint64_t offset_ = 0;
+    uint64_t indexed_ = 0;
+    int64_t lastTimestampUs_ = 0;
+    std::chrono::steady_clock::time_point flushed_;
+};
+
+struct ResultRecord {
+    int64_t timestampUs; // unix time
+    uint32_t latencyUs;
+    int32_t status;
+    const char* device;
+    size_t deviceLength;
+    const char* query;
+    size_t queryLength;
+    const char* body;
+    size_t bodyLength;
+};
+
+/**
+ * Reads the records of a result log directory with timestamps in
+ * [fromUs, toUs], optionally only for one device. Segments are memory
+ * mapped and the index is used to skip to the first record of interest;
+ * records of other devices are skipped without touching their bodies.
+ */
+class ResultLogReader {
+public:
+    typedef std::function<void(const ResultRecord& record)> Callback;
+    static bool query(const std::string& dir, const std::string& device, int64_t fromUs, int64_t toUs,
+                      Callback callback, std::string& error);
+};
+
+} // namespace
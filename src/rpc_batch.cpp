@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "rpc_batch.hpp"
+#include "output.hpp"
+#include "trace.hpp"
+#include "rpc_url.hpp"
+
+#include <iostream>
+
+
+namespace nabtocli {
+
+static const size_t MAX_CACHE_ENTRIES = 4096;
+
+RpcBatch::RpcBatch(Invoker invoker, size_t concurrency, size_t perDevice)
+    : invoker_(invoker), concurrency_(concurrency), scheduler_(concurrency, perDevice) {
+}
+
+void RpcBatch::setAdaptive(size_t initial) {
+    scheduler_.setAdaptive(initial, concurrency_);
+}
+
+void RpcBatch::setCache(std::chrono::milliseconds ttl, const std::set<std::string>& queries) {
+    cacheTtl_ = ttl;
+    cacheQueries_ = queries;
+}
+
+bool RpcBatch::cacheable(const std::string& url) {
+    return cacheTtl_.count() > 0 && cacheQueries_.count(rpcQueryName(url)) > 0;
+}
+
+void RpcBatch::submit(const std::string& url, Callback done) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    requests_++;
+    auto cached = cache_.find(url);
+    if (cached != cache_.end()) {
+        if (cached->second.expires > std::chrono::steady_clock::now()) {
+            cacheHits_++;
+            CacheEntry entry = cached->second;
+            lock.unlock();
+            done(entry.status, entry.json);
+            return;
+        }
+        cache_.erase(cached);
+    }
+    auto call = inFlight_.find(url);
+    if (call != inFlight_.end()) {
+        coalesced_++;
+        call->second.waiters.push_back(done);
+        return;
+    }
+    inFlight_[url].waiters.push_back(done);
+    invocations_++;
+    lock.unlock();
+    // bad urls get their own queue and fail in the invoker
+    std::string device;
+    extractHostFromUrl(url, device);
+    std::chrono::steady_clock::time_point queued = std::chrono::steady_clock::now();
+    scheduler_.submit(device, [this, url, queued] {
+            if (Trace::enabled()) {
+                Trace::span("rpc_queued", "rpc", queued, std::chrono::steady_clock::now(), url);
+            }
+            return invoke(url);
+        });
+}
+
+DeviceScheduler::Outcome RpcBatch::invoke(const std::string& url) {
+    std::string json;
+    bool sent = true;
+    nabto_status_t status = invoker_(url, json, sent);
+
+    std::vector<Callback> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // detach the waiters and remove the call under the same lock so
+        // later submits of this url start a new invocation
+        waiters.swap(inFlight_[url].waiters);
+        inFlight_.erase(url);
+        if (status == NABTO_OK && cacheable(url)) {
+            if (cache_.size() >= MAX_CACHE_ENTRIES) {
+                auto now = std::chrono::steady_clock::now();
+                for (auto it = cache_.begin(); it != cache_.end();) {
+                    if (it->second.expires <= now) {
+                        it = cache_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            if (cache_.size() < MAX_CACHE_ENTRIES) {
+                CacheEntry& entry = cache_[url];
+                entry.expires = std::chrono::steady_clock::now() + cacheTtl_;
+                entry.status = status;
+                entry.json = json;
+            }
+        }
+    }
+    for (auto&& done : waiters) {
+        done(status, json);
+    }
+    if (!sent) {
+        // e.g. failed fast on an open circuit breaker
+        return DeviceScheduler::NOT_SENT;
+    }
+    // an error response from the application says nothing about load
+    return status == NABTO_OK || status == NABTO_FAILED_WITH_JSON_MESSAGE ?
+        DeviceScheduler::SUCCEEDED : DeviceScheduler::FAILED;
+}
+
+void RpcBatch::wait() {
+    scheduler_.wait();
+}
+
+void RpcBatch::printStats() {
+    scheduler_.printStats();
+    std::lock_guard<std::mutex> lock(mutex_);
+    double ratio = 0;
+    if (requests_ > 0) {
+        ratio = 100.0 * (coalesced_ + cacheHits_) / requests_;
+    }
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("rpc_batch_stats");
+        event["requests"] = (Json::UInt64)requests_;
+        event["invocations"] = (Json::UInt64)invocations_;
+        event["coalesced"] = (Json::UInt64)coalesced_;
+        event["cache_hits"] = (Json::UInt64)cacheHits_;
+        event["coalescing_ratio"] = ratio / 100.0;
+        Output::emit(event);
+        return;
+    }
+    Output::results() << "RPC batch: " << requests_ << " requests, " << invocations_ << " device invocations, "
+                      << coalesced_ << " coalesced, " << cacheHits_ << " cache hits (coalescing ratio "
+                      << ratio << "%)" << std::endl;
+}
+
+} // namespace
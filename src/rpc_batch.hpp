@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "nabto_client_api.h"
+#include "device_scheduler.hpp"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <functional>
+
+
+namespace nabtocli {
+
+/**
+ * Runs RPC invocations concurrently on a worker pool, scheduled per
+ * device with at most perDevice invocations on one device at a time (0
+ * for no limit), or with an adaptive limit per device. Identical URLs
+ * submitted while an invocation of that URL is in flight share the
+ * result of that single invocation. Responses to allowlisted queries
+ * can optionally be cached for a short time.
+ */
+class RpcBatch {
+public:
+    // sent is true on entry; the invoker clears it if the call failed
+    // without reaching the SDK, e.g. on an open circuit breaker
+    typedef std::function<nabto_status_t(const std::string& url, std::string& json, bool& sent)> Invoker;
+    typedef std::function<void(nabto_status_t status, const std::string& json)> Callback;
+
+    RpcBatch(Invoker invoker, size_t concurrency, size_t perDevice = 0);
+    // adapt the per device limits to observed latency, see AdaptiveLimit
+    void setAdaptive(size_t initial);
+    void setCache(std::chrono::milliseconds ttl, const std::set<std::string>& queries);
+    void submit(const std::string& url, Callback done);
+    void wait();
+    // also prints per device queue statistics
+    void printStats();
+
+private:
+    struct Call {
+        std::vector<Callback> waiters;
+    };
+    struct CacheEntry {
+        std::chrono::steady_clock::time_point expires;
+        nabto_status_t status;
+        std::string json;
+    };
+
+    DeviceScheduler::Outcome invoke(const std::string& url);
+    bool cacheable(const std::string& url);
+
+    Invoker invoker_;
+    std::mutex mutex_;
+    std::map<std::string, Call> inFlight_;
+    std::map<std::string, CacheEntry> cache_;
+    std::chrono::milliseconds cacheTtl_ { 0 };
+    std::set<std::string> cacheQueries_;
+    size_t concurrency_;
+    size_t requests_ = 0;
+    size_t invocations_ = 0;
+    size_t coalesced_ = 0;
+    size_t cacheHits_ = 0;
+    // declared last so workers are joined before the state above is destroyed
+    DeviceScheduler scheduler_;
+};
+
+} // namespace
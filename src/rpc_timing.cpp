@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "rpc_timing.hpp"
+#include "json_helper.hpp"
+#include "output.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+
+#include <iostream>
+#include <fstream>
+
+
+namespace nabtocli {
+
+RpcTiming& RpcTiming::instance() {
+    // never destroyed, dumps may happen from atexit handlers and signal watcher threads
+    static RpcTiming* timing = new RpcTiming();
+    return *timing;
+}
+
+void RpcTiming::enable() {
+    RpcTiming& t = instance();
+    std::lock_guard<std::mutex> lock(t.mutex_);
+    t.enabled_ = true;
+}
+
+bool RpcTiming::enabled() {
+    RpcTiming& t = instance();
+    std::lock_guard<std::mutex> lock(t.mutex_);
+    return t.enabled_;
+}
+
+void RpcTiming::record(const char* phase, const std::string& device, const std::string& query, std::chrono::microseconds duration) {
+    RpcTiming& t = instance();
+    std::lock_guard<std::mutex> lock(t.mutex_);
+    if (!t.enabled_) {
+        return;
+    }
+    uint64_t us = duration.count() < 0 ? 0 : duration.count();
+    t.phases_[phase].record(us);
+    if (!device.empty()) {
+        t.devices_[device][phase].record(us);
+    }
+    if (!query.empty()) {
+        t.queries_[query].record(us);
+    }
+}
+
+Json::Value RpcTiming::toJson() {
+    RpcTiming& t = instance();
+    std::lock_guard<std::mutex> lock(t.mutex_);
+    Json::Value doc;
+    doc["phases"] = Json::Value(Json::objectValue);
+    for (auto&& p : t.phases_) {
+        doc["phases"][p.first] = p.second.toJson("us");
+    }
+    doc["devices"] = Json::Value(Json::objectValue);
+    for (auto&& d : t.devices_) {
+        for (auto&& p : d.second) {
+            doc["devices"][d.first][p.first] = p.second.toJson("us");
+        }
+    }
+    doc["queries"] = Json::Value(Json::objectValue);
+    for (auto&& q : t.queries_) {
+        doc["queries"][q.first] = q.second.toJson("us");
+    }
+    return doc;
+}
+
+bool RpcTiming::dump(const std::string& file) {
+    if (file.empty() && Output::ndjson()) {
+        Json::Value event = Output::event("rpc_timing");
+        event["timing"] = toJson();
+        Output::emit(event);
+        return true;
+    }
+    std::string json = nabto::JsonHelper::toString(toJson());
+    if (file.empty()) {
+        // stderr, a dump on SIGUSR1 must not land in the middle of command results on stdout
+        std::cerr << json << std::endl;
+        return true;
+    }
+    std::ofstream ofs(file.c_str(), std::ofstream::out | std::ofstream::trunc);
+    if (!ofs.good()) {
+        CLI_LOG_ERROR("Failed to write RPC timing file: " << file);
+        return false;
+    }
+    ofs << json << std::endl;
+    return ofs.good();
+}
+
+RpcPhaseTimer::RpcPhaseTimer(const char* phase, const std::string& device, const std::string& query)
+    : phase_(phase), device_(device), query_(query), start_(std::chrono::steady_clock::now()) {
+}
+
+RpcPhaseTimer::~RpcPhaseTimer() {
+    auto end = std::chrono::steady_clock::now();
+    RpcTiming::record(phase_, device_, query_, std::chrono::duration_cast<std::chrono::microseconds>(end - start_));
+    if (Trace::enabled()) {
+        Trace::span(phase_, "rpc", start_, end, query_.empty() ? device_ : device_ + " " + query_);
+    }
+}
+
+} // namespace
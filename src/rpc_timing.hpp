@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "histogram.hpp"
+
+#include <json/json.h>
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+
+
+namespace nabtocli {
+
+/**
+ * Opt-in latency histograms for the phases of an RPC invocation
+ * (session open, interface load, interface check, PSK setup and the
+ * invocation itself), aggregated per phase, per device and per query.
+ */
+class RpcTiming {
+private:
+    std::mutex mutex_;
+    bool enabled_ = false;
+    std::map<std::string, Histogram> phases_;
+    std::map<std::string, std::map<std::string, Histogram> > devices_;
+    std::map<std::string, Histogram> queries_;
+    static RpcTiming& instance();
+public:
+    static void enable();
+    static bool enabled();
+    static void record(const char* phase, const std::string& device, const std::string& query, std::chrono::microseconds duration);
+    static Json::Value toJson();
+    // write histograms as JSON to file, or if file is empty as an
+    // rpc_timing event with --output ndjson and to stderr otherwise
+    static bool dump(const std::string& file);
+};
+
+/**
+ * Records the time from construction to destruction as the given
+ * phase, if timing is enabled, and as a trace span if tracing is.
+ */
+class RpcPhaseTimer {
+private:
+    const char* phase_;
+    std::string device_;
+    std::string query_;
+    std::chrono::steady_clock::time_point start_;
+public:
+    RpcPhaseTimer(const char* phase, const std::string& device = "", const std::string& query = "");
+    ~RpcPhaseTimer();
+};
+
+} // namespace
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "rpc_url.hpp"
+
+#include <cstring>
+
+
+namespace nabtocli {
+
+static const char SCHEME[] = "nabto://";
+static const size_t SCHEME_LENGTH = sizeof(SCHEME) - 1;
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+enum {
+    HOST = 1,       // allowed in host names
+    UNRESERVED = 2, // not percent-encoded in parameter values
+    VISIBLE = 4     // allowed in path and query
+};
+
+struct CharTable {
+    unsigned char flags[256];
+    CharTable() {
+        for (int i = 0; i < 256; i++) {
+            flags[i] = (i > 0x20 && i < 0x7f) ? VISIBLE : 0;
+        }
+        for (int i = 0; i < 26; i++) {
+            flags['a' + i] |= HOST | UNRESERVED;
+            flags['A' + i] |= HOST | UNRESERVED;
+        }
+        for (int i = 0; i < 10; i++) {
+            flags['0' + i] |= HOST | UNRESERVED;
+        }
+        flags['.'] |= HOST | UNRESERVED;
+        flags['-'] |= HOST | UNRESERVED;
+        flags['_'] |= HOST | UNRESERVED;
+        flags['~'] |= UNRESERVED;
+        // non-ASCII bytes are allowed in path and query, i.e. UTF-8 parameters
+        for (int i = 0x80; i < 256; i++) {
+            flags[i] = VISIBLE;
+        }
+    }
+};
+
+static const CharTable CHARS;
+
+static inline bool is(char c, int flag) {
+    return (CHARS.flags[(unsigned char)c] & flag) != 0;
+}
+
+bool UrlPart::equals(const char* text) const {
+    return strlen(text) == size && memcmp(data, text, size) == 0;
+}
+
+bool RpcUrl::parse(const char* url, size_t length) {
+    if (length <= SCHEME_LENGTH || memcmp(url, SCHEME, SCHEME_LENGTH) != 0) {
+        return false;
+    }
+    const char* end = url + length;
+    const char* p = url + SCHEME_LENGTH;
+    const char* host = p;
+    while (p < end && is(*p, HOST)) {
+        p++;
+    }
+    if (p == host || p == end || *p != '/') {
+        return false;
+    }
+    const char* path = ++p;
+    while (p < end && *p != '?' && is(*p, VISIBLE)) {
+        p++;
+    }
+    const char* pathEnd = p;
+    if (p == path || (p < end && *p != '?')) {
+        return false;
+    }
+    const char* query = p < end ? ++p : end;
+    while (p < end && is(*p, VISIBLE)) {
+        p++;
+    }
+    if (p != end) {
+        return false;
+    }
+    scheme_ = UrlPart(url, SCHEME_LENGTH - 3);
+    host_ = UrlPart(host, path - 1 - host);
+    path_ = UrlPart(path, pathEnd - path);
+    query_ = UrlPart(query, end - query);
+    return true;
+}
+
+UrlPart RpcUrl::request() const {
+    return UrlPart(path_.data, query_.data + query_.size - path_.data);
+}
+
+bool RpcUrl::nextParameter(size_t& position, UrlPart& name, UrlPart& value) const {
+    while (position < query_.size) {
+        const char* start = query_.data + position;
+        const char* amp = static_cast<const char*>(memchr(start, '&', query_.size - position));
+        const char* end = amp ? amp : query_.data + query_.size;
+        position = end - query_.data + (amp ? 1 : 0);
+        if (end == start) {
+            // empty parameter, e.g. "a=1&&b=2"
+            continue;
+        }
+        const char* eq = static_cast<const char*>(memchr(start, '=', end - start));
+        name = UrlPart(start, (eq ? eq : end) - start);
+        value = eq ? UrlPart(eq + 1, end - eq - 1) : UrlPart(end, 0);
+        return true;
+    }
+    return false;
+}
+
+RpcUrlBuilder& RpcUrlBuilder::reset(const std::string& host, const std::string& path) {
+    buffer_.clear();
+    buffer_.append(SCHEME, SCHEME_LENGTH);
+    buffer_.append(host);
+    buffer_.push_back('/');
+    buffer_.append(path);
+    hasQuery_ = path.find('?') != std::string::npos;
+    return *this;
+}
+
+RpcUrlBuilder& RpcUrlBuilder::param(const std::string& name, const std::string& value) {
+    if (!hasQuery_) {
+        buffer_.push_back('?');
+        hasQuery_ = true;
+    } else if (buffer_.back() != '?' && buffer_.back() != '&') {
+        buffer_.push_back('&');
+    }
+    percentEncode(name, buffer_);
+    buffer_.push_back('=');
+    percentEncode(value, buffer_);
+    return *this;
+}
+
+void RpcUrlBuilder::percentEncode(const std::string& value, std::string& out) {
+    const char* p = value.data();
+    const char* end = p + value.size();
+    while (p < end) {
+        // copy runs of unreserved characters in one append
+        const char* run = p;
+        while (p < end && is(*p, UNRESERVED)) {
+            p++;
+        }
+        out.append(run, p - run);
+        if (p < end) {
+            unsigned char b = (unsigned char)*p++;
+            char escaped[3] = { '%', HEX_DIGITS[b >> 4], HEX_DIGITS[b & 0x0f] };
+            out.append(escaped, 3);
+        }
+    }
+}
+
+bool extractHostFromUrl(const std::string& url, std::string& host) {
+    RpcUrl view;
+    if (!view.parse(url)) {
+        return false;
+    }
+    host.assign(view.host().data, view.host().size);
+    return true;
+}
+
+std::string rpcQueryName(const std::string& url) {
+    RpcUrl view;
+    return view.parse(url) ? view.path().str() : "";
+}
+
+} // namespace
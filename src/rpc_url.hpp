@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+
+namespace nabtocli {
+
+/**
+ * Non-owning reference to a part of a string.
+ */
+struct UrlPart {
+    const char* data;
+    size_t size;
+
+    UrlPart() : data(0), size(0) {}
+    UrlPart(const char* d, size_t s) : data(d), size(s) {}
+    bool empty() const { return size == 0; }
+    bool equals(const char* text) const;
+    std::string str() const { return std::string(data, size); }
+};
+
+/**
+ * Validated view of a nabto://<host>/<path>[?<name>=<value>&...] URL.
+ * Parsing does not allocate; the parts point into the parsed string,
+ * which must outlive the view. The host may only contain letters,
+ * digits, '.', '-' and '_', the path must not be empty, and no part may
+ * contain whitespace or control characters. Parameters are returned as
+ * they appear in the URL, i.e. still percent-encoded.
+ */
+class RpcUrl {
+public:
+    bool parse(const char* url, size_t length);
+    bool parse(const std::string& url) { return parse(url.data(), url.size()); }
+    // the view would point into a destroyed temporary
+    bool parse(std::string&& url) = delete;
+
+    UrlPart scheme() const { return scheme_; }
+    UrlPart host() const { return host_; }
+    // e.g. "get_public_device_info.json"
+    UrlPart path() const { return path_; }
+    // everything after '?', empty if there are no parameters
+    UrlPart query() const { return query_; }
+    // path and query, i.e. everything after "nabto://<host>/"
+    UrlPart request() const;
+
+    // iterate parameters, start with position 0; false when there are no more
+    bool nextParameter(size_t& position, UrlPart& name, UrlPart& value) const;
+
+private:
+    UrlPart scheme_;
+    UrlPart host_;
+    UrlPart path_;
+    UrlPart query_;
+};
+
+/**
+ * Builds nabto://<host>/<path>?<name>=<value>&... URLs into a buffer
+ * that is reused between URLs. Parameter values are percent-encoded,
+ * everything but the RFC 3986 unreserved characters is escaped.
+ */
+class RpcUrlBuilder {
+public:
+    // starts a new URL, the path is added as is and may contain parameters
+    RpcUrlBuilder& reset(const std::string& host, const std::string& path);
+    RpcUrlBuilder& param(const std::string& name, const std::string& value);
+    const std::string& str() const { return buffer_; }
+    const char* c_str() const { return buffer_.c_str(); }
+
+    static void percentEncode(const std::string& value, std::string& out);
+
+private:
+    std::string buffer_;
+    bool hasQuery_ = false;
+};
+
+// host part of a nabto url, e.g. "demo.nabto.net"; false if the url is invalid
+bool extractHostFromUrl(const std::string& url, std::string& host);
+
+// query name of a nabto url, e.g. "get_public_device_info.json"
+std::string rpcQueryName(const std::string& url);
+
+} // namespace
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "scenario.hpp"
+#include "worker_pool.hpp"
+#include "output.hpp"
+#include "json_helper.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+
+
+namespace nabtocli {
+
+bool Scenario::load(const std::string& file, std::string& error) {
+    std::ifstream ifs(file.c_str(), std::ifstream::in);
+    if (!ifs.good()) {
+        error = "Failed to open scenario file: " + file;
+        return false;
+    }
+    std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    Json::Value doc;
+    std::string parseErrors;
+    if (!nabto::JsonHelper::parse(content, doc, parseErrors) || !doc.isObject()) {
+        error = "Invalid scenario file " + file + ": " + parseErrors;
+        return false;
+    }
+
+    rate_ = doc.get("rate", rate_).asDouble();
+    duration_ = std::chrono::seconds(doc.get("duration", (Json::Int64)duration_.count()).asInt64());
+    concurrency_ = doc.get("concurrency", (Json::UInt64)concurrency_).asUInt64();
+    sessions_ = doc.get("sessions", (Json::UInt64)sessions_).asUInt64();
+    reportInterval_ = std::chrono::seconds(doc.get("report_interval", (Json::Int64)reportInterval_.count()).asInt64());
+    std::string arrivals = doc.get("arrivals", "poisson").asString();
+    if (rate_ <= 0 || duration_.count() <= 0 || concurrency_ < 1 || sessions_ < 1 || reportInterval_.count() <= 0) {
+        error = "rate, duration, concurrency, sessions and report_interval must be positive";
+        return false;
+    }
+    if (arrivals != "poisson" && arrivals != "constant") {
+        error = "arrivals must be poisson or constant";
+        return false;
+    }
+    poisson_ = arrivals == "poisson";
+
+    uint64_t totalWeight = 0;
+    for (auto& o : doc["operations"]) {
+        ScenarioOperation op;
+        const Json::Value& weight = o.get("weight", 1);
+        if (!weight.isUInt()) {
+            error = "Scenario operation " + std::to_string(operations_.size() + 1) + " weight must be a non-negative integer";
+            return false;
+        }
+        op.weight = weight.asUInt();
+        totalWeight += op.weight;
+        op.hold = std::chrono::milliseconds(o.get("hold_ms", 0).asInt64());
+        if (o.isMember("rpc")) {
+            op.type = ScenarioOperation::RPC;
+            op.url = o["rpc"].asString();
+        } else if (o.isMember("tunnel") && o.isMember("device")) {
+            op.type = ScenarioOperation::TUNNEL;
+            op.tunnel = o["tunnel"].asString();
+            op.device = o["device"].asString();
+        } else {
+            error = "Scenario operation " + std::to_string(operations_.size() + 1) + " needs rpc or tunnel and device";
+            return false;
+        }
+        op.name = o.get("name", op.type == ScenarioOperation::RPC ? op.url : op.tunnel).asString();
+        operations_.push_back(op);
+    }
+    if (operations_.empty()) {
+        error = "Scenario has no operations";
+        return false;
+    }
+    if (totalWeight == 0) {
+        error = "Scenario operation weights must not all be zero";
+        return false;
+    }
+    return true;
+}
+
+void Scenario::stop() {
+    {
+        std::lock_guard<std::mutex> lock(stopMutex_);
+        stop_ = true;
+    }
+    stopCond_.notify_all();
+}
+
+bool Scenario::sleepUntil(Clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(stopMutex_);
+    return !stopCond_.wait_until(lock, deadline, [this] { return stop_.load(); });
+}
+
+void Scenario::record(size_t op, bool ok, Clock::duration latency) {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    std::lock_guard<std::mutex> lock(mutex_);
+    interval_[op].latency.record(us);
+    if (!ok) {
+        interval_[op].errors++;
+    }
+}
+
+void Scenario::run(Executor executor) {
+    interval_.assign(operations_.size(), OperationStats());
+    total_.assign(operations_.size(), OperationStats());
+
+    std::vector<unsigned> weights;
+    for (auto& op : operations_) {
+        weights.push_back(op.weight);
+    }
+    std::mt19937_64 rng(std::random_device{}());
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    std::exponential_distribution<double> gap(rate_);
+    std::chrono::duration<double> meanGap(1.0 / rate_);
+
+    WorkerPool pool(concurrency_);
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + duration_;
+    Clock::time_point lastReport = start;
+    Clock::time_point next = start;
+    uint64_t seq = 0;
+
+    while (!stop_) {
+        std::chrono::duration<double> wait = poisson_ ? std::chrono::duration<double>(gap(rng)) : meanGap;
+        next += std::chrono::duration_cast<Clock::duration>(wait);
+        Clock::time_point nextReport = lastReport + reportInterval_;
+        if (nextReport <= next || end <= next) {
+            if (!sleepUntil(std::min(nextReport, end))) {
+                break;
+            }
+            Clock::time_point now = Clock::now();
+            if (now >= end) {
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            report("scenario_report", interval_, now - start, now - lastReport);
+            lastReport = now;
+        }
+        if (next >= end) {
+            sleepUntil(end);
+            break;
+        }
+        if (!sleepUntil(next)) {
+            break;
+        }
+
+        size_t op = pick(rng);
+        if (inFlight_ >= concurrency_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            interval_[op].dropped++;
+            continue;
+        }
+        inFlight_++;
+        Clock::time_point scheduled = next;
+        uint64_t opSeq = seq++;
+        pool.post([this, op, opSeq, scheduled, &executor]() {
+                bool ok = executor(operations_[op], opSeq);
+                record(op, ok, Clock::now() - scheduled);
+                inFlight_--;
+            });
+    }
+    pool.wait();
+
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    report("scenario_report", interval_, now - start, now - lastReport);
+    report("scenario_summary", total_, now - start, now - start);
+}
+
+// prints and resets stats, folding interval stats into the totals
+void Scenario::report(const char* event, std::vector<OperationStats>& stats, Clock::duration elapsed, Clock::duration interval) {
+    double seconds = std::chrono::duration<double>(interval).count();
+    double elapsedSeconds = std::chrono::duration<double>(elapsed).count();
+    Json::Value doc = Output::event(event);
+    doc["elapsed_s"] = elapsedSeconds;
+    doc["interval_s"] = seconds;
+    doc["in_flight"] = (Json::UInt64)inFlight_;
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(1)
+         << (&stats == &total_ ? "Summary" : "Report") << " at " << elapsedSeconds << " s, "
+         << inFlight_ << " in flight" << std::endl;
+    for (size_t i = 0; i < operations_.size(); i++) {
+        OperationStats& s = stats[i];
+        uint64_t count = s.latency.count();
+        double throughput = seconds > 0 ? count / seconds : 0;
+        double errorRate = count ? (double)s.errors / count : 0;
+        Json::Value op = s.latency.toJson("us");
+        op["throughput"] = throughput;
+        op["errors"] = (Json::UInt64)s.errors;
+        op["error_rate"] = errorRate;
+        op["dropped"] = (Json::UInt64)s.dropped;
+        doc["operations"][operations_[i].name] = op;
+        text << "  " << operations_[i].name << ": " << count << " ops (" << throughput << "/s), "
+             << s.errors << " errors (" << 100 * errorRate << "%), " << s.dropped << " dropped, "
+             << "p50 " << s.latency.percentile(50) / 1000.0 << " ms, p90 " << s.latency.percentile(90) / 1000.0
+             << " ms, p99 " << s.latency.percentile(99) / 1000.0 << " ms, max " << s.latency.max() / 1000.0 << " ms" << std::endl;
+        if (&stats != &total_) {
+            total_[i].latency.merge(s.latency);
+            total_[i].errors += s.errors;
+            total_[i].dropped += s.dropped;
+            s = OperationStats();
+        }
+    }
+    if (Output::ndjson()) {
+        Output::emit(doc);
+    } else {
+        Output::results() << text.str();
+    }
+}
+
+} // namespace
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "histogram.hpp"
+
+#include <json/json.h>
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+
+
+namespace nabtocli {
+
+struct ScenarioOperation {
+    enum Type { RPC, TUNNEL };
+    std::string name;
+    Type type;
+    unsigned weight;
+    // rpc
+    std::string url;
+    // tunnel spec <local port>:<remote host>:<remote port>, device and
+    // how long to keep the tunnel open once connected
+    std::string tunnel;
+    std::string device;
+    std::chrono::milliseconds hold;
+};
+
+/**
+ * Open loop load generator. Operations are picked from a weighted mix
+ * and started at a fixed average arrival rate regardless of how fast
+ * earlier operations complete. Latency is measured from the scheduled
+ * arrival, so a slow system is not hidden by arrivals waiting for it.
+ * Arrivals finding the concurrency cap reached are dropped and counted.
+ *
+ * Scenario file:
+ *   { "rate": 20, "duration": 60, "concurrency": 16, "report_interval": 5,
+ *     "arrivals": "poisson", "sessions": 1,
+ *     "operations": [
+ *       { "name": "info", "weight": 9, "rpc": "nabto://<device>/get_public_device_info.json?" },
+ *       { "name": "tunnel", "weight": 1, "tunnel": "0:localhost:80", "device": "<device>", "hold_ms": 500 } ] }
+ */
+class Scenario {
+public:
+    // run one operation, seq numbers arrivals from 0, true on success
+    typedef std::function<bool(const ScenarioOperation& op, uint64_t seq)> Executor;
+
+    bool load(const std::string& file, std::string& error);
+    const std::vector<ScenarioOperation>& operations() const { return operations_; }
+    size_t sessions() const { return sessions_; }
+    // run for the configured duration or until stopped, printing reports
+    void run(Executor executor);
+    // thread safe
+    void stop();
+
+private:
+    struct OperationStats {
+        Histogram latency;
+        uint64_t errors = 0;
+        uint64_t dropped = 0;
+    };
+    typedef std::chrono::steady_clock Clock;
+
+    // false if stopped before deadline
+    bool sleepUntil(Clock::time_point deadline);
+    void record(size_t op, bool ok, Clock::duration latency);
+    void report(const char* event, std::vector<OperationStats>& stats, Clock::duration elapsed, Clock::duration interval);
+
+    std::vector<ScenarioOperation> operations_;
+    double rate_ = 1;
+    std::chrono::seconds duration_ { 10 };
+    size_t concurrency_ = 16;
+    size_t sessions_ = 1;
+    std::chrono::seconds reportInterval_ { 5 };
+    bool poisson_ = true;
+
+    std::mutex mutex_;
+    std::vector<OperationStats> interval_;
+    std::vector<OperationStats> total_;
+    std::atomic<size_t> inFlight_ { 0 };
+    std::atomic<bool> stop_ { false };
+    std::mutex stopMutex_;
+    std::condition_variable stopCond_;
+};
+
+} // namespace
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "signals.hpp"
+#include "output.hpp"
+#include "log.hpp"
+#include "nabto_client_api.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+
+namespace nabtocli {
+
+// grace period after the deadline before the shutdown is forced
+static const std::chrono::seconds SHUTDOWN_GRACE(2);
+
+#ifndef WIN32
+
+static int signalPipe_[2] = { -1, -1 };
+static std::mutex signalMutex_;
+static std::map<int, SignalDispatcher::Callback> signalCallbacks_;
+
+static void selfPipeHandler(int signo) {
+    int saved = errno;
+    unsigned char b = (unsigned char)signo;
+    ssize_t ignored = write(signalPipe_[1], &b, 1);
+    (void)ignored;
+    errno = saved;
+}
+
+static void dispatchSignals() {
+    while (true) {
+        unsigned char b;
+        ssize_t n = read(signalPipe_[0], &b, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return;
+        }
+        SignalDispatcher::Callback callback;
+        {
+            std::lock_guard<std::mutex> lock(signalMutex_);
+            auto it = signalCallbacks_.find(b);
+            if (it != signalCallbacks_.end()) {
+                callback = it->second;
+            }
+        }
+        if (callback) {
+            callback();
+        }
+    }
+}
+
+bool SignalDispatcher::onSignal(int signo, Callback callback) {
+    std::lock_guard<std::mutex> lock(signalMutex_);
+    if (signalPipe_[0] < 0) {
+        if (pipe(signalPipe_) != 0) {
+            return false;
+        }
+        fcntl(signalPipe_[1], F_SETFL, fcntl(signalPipe_[1], F_GETFL) | O_NONBLOCK);
+        fcntl(signalPipe_[0], F_SETFD, FD_CLOEXEC);
+        fcntl(signalPipe_[1], F_SETFD, FD_CLOEXEC);
+        std::thread(dispatchSignals).detach();
+    }
+    signalCallbacks_[signo] = callback;
+    struct sigaction sa;
+    sa.sa_handler = selfPipeHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    return sigaction(signo, &sa, NULL) == 0;
+}
+
+#else
+
+bool SignalDispatcher::onSignal(int signo, Callback callback) {
+    return false;
+}
+
+#endif
+
+static std::mutex shutdownMutex_;
+static std::map<int, ShutdownCoordinator::Hook> shutdownHooks_;
+static int nextHookId_ = 0;
+static std::chrono::milliseconds shutdownDeadline_(0);
+static std::chrono::steady_clock::time_point shutdownStart_;
+static std::chrono::steady_clock::time_point shutdownEnd_;
+static std::atomic<bool> shutdownRequested_ { false };
+static std::atomic<bool> shutdownCompleted_ { false };
+
+static void reportShutdown(bool forced) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - shutdownStart_).count();
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("shutdown");
+        event["duration_ms"] = (Json::Int64)ms;
+        event["forced"] = forced;
+        Output::emit(event);
+    } else {
+        CLI_LOG_INFO((forced ? "Forced shutdown after " : "Shutdown completed in ") << ms << " ms");
+    }
+}
+
+static void forceShutdown() {
+    reportShutdown(true);
+    nabtoShutdown();
+    Log::flush();
+    std::cout.flush();
+    fflush(stdout);
+    // other threads still use the SDK, so no atexit handlers or static destructors
+    _exit(1);
+}
+
+// nothing to wind down, shut down the SDK and exit
+static void exitNow() {
+    shutdownCompleted_ = true;
+    nabtoShutdown();
+    Log::flush();
+    std::cout.flush();
+    fflush(stdout);
+    // the main thread may still be inside an SDK call, same as forceShutdown
+    _exit(0);
+}
+
+static void beginShutdown() {
+    if (shutdownRequested_.exchange(true)) {
+        // second signal, the user does not want to wait
+        forceShutdown();
+    }
+    std::vector<ShutdownCoordinator::Hook> hooks;
+    {
+        std::lock_guard<std::mutex> lock(shutdownMutex_);
+        shutdownStart_ = std::chrono::steady_clock::now();
+        shutdownEnd_ = shutdownStart_ + shutdownDeadline_;
+        for (auto&& hook : shutdownHooks_) {
+            hooks.push_back(hook.second);
+        }
+    }
+    if (hooks.empty()) {
+        exitNow();
+    }
+    if (!Output::ndjson()) {
+        CLI_LOG_INFO("Shutting down, deadline " << shutdownDeadline_.count() << " ms");
+    }
+    for (auto&& hook : hooks) {
+        hook();
+    }
+    std::thread([]() {
+            auto limit = ShutdownCoordinator::deadline() + SHUTDOWN_GRACE;
+            while (std::chrono::steady_clock::now() < limit) {
+                if (shutdownCompleted_) {
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+            if (!shutdownCompleted_) {
+                forceShutdown();
+            }
+        }).detach();
+}
+
+bool ShutdownCoordinator::install(std::chrono::milliseconds deadline) {
+    {
+        std::lock_guard<std::mutex> lock(shutdownMutex_);
+        shutdownDeadline_ = deadline;
+    }
+#ifndef WIN32
+    return SignalDispatcher::onSignal(SIGINT, beginShutdown) &&
+        SignalDispatcher::onSignal(SIGTERM, beginShutdown);
+#else
+    return false;
+#endif
+}
+
+int ShutdownCoordinator::addHook(Hook hook) {
+    std::lock_guard<std::mutex> lock(shutdownMutex_);
+    int id = nextHookId_++;
+    shutdownHooks_[id] = hook;
+    return id;
+}
+
+void ShutdownCoordinator::removeHook(int id) {
+    std::lock_guard<std::mutex> lock(shutdownMutex_);
+    shutdownHooks_.erase(id);
+}
+
+bool ShutdownCoordinator::requested() {
+    return shutdownRequested_;
+}
+
+std::chrono::steady_clock::time_point ShutdownCoordinator::deadline() {
+    std::lock_guard<std::mutex> lock(shutdownMutex_);
+    return shutdownEnd_;
+}
+
+void ShutdownCoordinator::completed() {
+    if (shutdownRequested_ && !shutdownCompleted_.exchange(true)) {
+        reportShutdown(false);
+    }
+}
+
+} // namespace
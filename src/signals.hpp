@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+
+
+namespace nabtocli {
+
+/**
+ * Signal handling through a self-pipe. The signal handler only writes
+ * the signal number to a pipe, registered callbacks run on a dedicated
+ * thread where they may use any API.
+ */
+class SignalDispatcher {
+public:
+    typedef std::function<void()> Callback;
+    // register callback for signo, returns false if signals are unsupported
+    static bool onSignal(int signo, Callback callback);
+};
+
+/**
+ * Graceful shutdown on SIGINT and SIGTERM. A command registers a hook
+ * for the phases it can wind down (drain tunnels, stop streams and
+ * pollers), and removes it when the phase ends. Hooks run on the signal
+ * thread and ask the command to finish within the deadline. The command
+ * then returns normally and calls completed(). If it does not finish
+ * within the deadline plus a grace period, or a second signal arrives,
+ * the SDK is shut down and the process exits. Without registered hooks
+ * the SDK is shut down and the process exits right away.
+ */
+class ShutdownCoordinator {
+public:
+    typedef std::function<void()> Hook;
+    static bool install(std::chrono::milliseconds deadline);
+    // returns an id for removeHook
+    static int addHook(Hook hook);
+    static void removeHook(int id);
+    static bool requested();
+    static std::chrono::steady_clock::time_point deadline();
+    // report the shutdown duration if a shutdown was requested
+    static void completed();
+};
+
+} // namespace
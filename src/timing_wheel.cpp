@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "timing_wheel.hpp"
+
+
+namespace nabtocli {
+
+const int TimingWheel::LEVELS;
+const int TimingWheel::BITS;
+const uint32_t TimingWheel::SLOTS;
+const uint32_t TimingWheel::NONE;
+
+TimingWheel::TimingWheel() : heads_(LEVELS * SLOTS, NONE) {
+}
+
+void TimingWheel::schedule(uint32_t id, uint64_t due) {
+    if (id >= next_.size()) {
+        next_.resize(id + 1, NONE);
+        due_.resize(id + 1, 0);
+    }
+    // overdue timers expire on the next tick
+    due_[id] = due > current_ ? due : current_ + 1;
+    insert(id);
+}
+
+void TimingWheel::insert(uint32_t id) {
+    uint64_t due = due_[id];
+    uint64_t delta = due - current_;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t)1 << (BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >> (BITS * LEVELS)) {
+        // beyond the last wheel, park it in the furthest slot and cascade again later
+        due = current_ + ((uint64_t)1 << (BITS * LEVELS)) - 1;
+    }
+    uint32_t slot = level * SLOTS + ((due >> (BITS * level)) & (SLOTS - 1));
+    next_[id] = heads_[slot];
+    heads_[slot] = id;
+}
+
+void TimingWheel::cascade(int level, uint32_t slot) {
+    uint32_t id = heads_[level * SLOTS + slot];
+    heads_[level * SLOTS + slot] = NONE;
+    while (id != NONE) {
+        uint32_t next = next_[id];
+        insert(id);
+        id = next;
+    }
+}
+
+void TimingWheel::advance(uint64_t now, std::vector<uint32_t>& expired) {
+    while (current_ < now) {
+        current_++;
+        // when a wheel wraps, move the next slot of the coarser wheel down
+        for (int level = 1; level < LEVELS; level++) {
+            if (current_ & (((uint64_t)1 << (BITS * level)) - 1)) {
+                break;
+            }
+            cascade(level, (current_ >> (BITS * level)) & (SLOTS - 1));
+        }
+        uint32_t& head = heads_[current_ & (SLOTS - 1)];
+        for (uint32_t id = head; id != NONE; id = next_[id]) {
+            expired.push_back(id);
+        }
+        head = NONE;
+    }
+}
+
+} // namespace
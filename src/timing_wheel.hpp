@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+
+namespace nabtocli {
+
+/**
+ * Hierarchical timing wheel of integer timer ids, in the style of the
+ * classic Linux kernel timers. Four wheels of 256 slots cover 2^32
+ * ticks. A timer is inserted into the wheel matching how far away it is
+ * and moves to a finer wheel when the coarser wheel's slot comes round,
+ * so schedule is O(1) and advance is O(1) per tick plus the timers that
+ * expire or cascade. Not thread safe.
+ */
+class TimingWheel {
+public:
+    TimingWheel();
+    // expire id at tick due, ids are small and dense, each scheduled at most once
+    void schedule(uint32_t id, uint64_t due);
+    // advance to tick now, appending expired ids tick by tick
+    void advance(uint64_t now, std::vector<uint32_t>& expired);
+    // the last tick advanced to
+    uint64_t tick() const { return current_; }
+
+private:
+    static const int LEVELS = 4;
+    static const int BITS = 8;
+    static const uint32_t SLOTS = 1 << BITS;
+    static const uint32_t NONE = UINT32_MAX;
+
+    void insert(uint32_t id);
+    void cascade(int level, uint32_t slot);
+
+    // singly linked lists of ids per slot
+    std::vector<uint32_t> heads_;
+    std::vector<uint32_t> next_;
+    std::vector<uint64_t> due_;
+    uint64_t current_ = 0;
+};
+
+} // namespace
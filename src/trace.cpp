@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "trace.hpp"
+#include "log.hpp"
+
+#include <json/json.h>
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <cstdlib>
+
+
+namespace nabtocli {
+
+// bounds memory use of long runs, later spans are counted and dropped
+static const size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+static const Trace::Clock::time_point traceStart_ = Trace::Clock::now();
+
+std::atomic<bool> Trace::enabled_ { false };
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    Trace::Clock::time_point start;
+    Trace::Clock::time_point end;
+    std::string detail;
+    int track;
+};
+
+// the mutex is only contended while the file is written
+struct ThreadBuffer {
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    size_t dropped = 0;
+    int tid;
+};
+
+std::mutex registryMutex_;
+std::vector<std::shared_ptr<ThreadBuffer> > buffers_;
+std::vector<std::pair<int, std::string> > trackNames_;
+std::string file_;
+std::atomic<int> nextTid_ { 1 };
+thread_local std::shared_ptr<ThreadBuffer> buffer_;
+
+ThreadBuffer& threadBuffer() {
+    if (!buffer_) {
+        buffer_ = std::make_shared<ThreadBuffer>();
+        buffer_->tid = nextTid_++;
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        buffers_.push_back(buffer_);
+    }
+    return *buffer_;
+}
+
+double micros(Trace::Clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(t - traceStart_).count();
+}
+
+void writeAtExit() {
+    Trace::write();
+}
+
+} // namespace
+
+void Trace::enable(const std::string& file) {
+    file_ = file;
+    enabled_ = true;
+    atexit(writeAtExit);
+}
+
+void Trace::span(const char* name, const char* category, Clock::time_point start, Clock::time_point end,
+                 const std::string& detail, int track) {
+    if (!enabled()) {
+        return;
+    }
+    ThreadBuffer& b = threadBuffer();
+    std::lock_guard<std::mutex> lock(b.mutex);
+    if (b.events.size() >= MAX_EVENTS_PER_THREAD) {
+        b.dropped++;
+        return;
+    }
+    TraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.start = start;
+    event.end = end;
+    event.detail = detail;
+    event.track = track;
+    b.events.push_back(std::move(event));
+}
+
+void Trace::nameTrack(int track, const std::string& name) {
+    if (!enabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    trackNames_.push_back(std::make_pair(track, name));
+}
+
+bool Trace::write() {
+    if (!enabled_.exchange(false)) {
+        return true;
+    }
+    std::ofstream ofs(file_.c_str(), std::ofstream::out | std::ofstream::trunc);
+    if (!ofs.good()) {
+        CLI_LOG_ERROR("Failed to write trace file: " << file_);
+        return false;
+    }
+    size_t count = 0;
+    size_t dropped = 0;
+    const char* separator = "\n";
+    ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    std::lock_guard<std::mutex> registryLock(registryMutex_);
+    for (auto& b : buffers_) {
+        std::lock_guard<std::mutex> lock(b->mutex);
+        for (auto& e : b->events) {
+            ofs << separator << "{\"name\":" << Json::valueToQuotedString(e.name)
+                << ",\"cat\":" << Json::valueToQuotedString(e.category)
+                << ",\"ph\":\"X\",\"ts\":" << micros(e.start)
+                << ",\"dur\":" << micros(e.end) - micros(e.start)
+                << ",\"pid\":1,\"tid\":" << (e.track ? e.track : b->tid);
+            if (!e.detail.empty()) {
+                ofs << ",\"args\":{\"detail\":" << Json::valueToQuotedString(e.detail.c_str()) << "}";
+            }
+            ofs << "}";
+            separator = ",\n";
+            count++;
+        }
+        dropped += b->dropped;
+    }
+    for (auto& t : trackNames_) {
+        ofs << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t.first
+            << ",\"args\":{\"name\":" << Json::valueToQuotedString(t.second.c_str()) << "}}";
+        separator = ",\n";
+    }
+    ofs << "\n]}\n";
+    CLI_LOG_INFO("Wrote " << count << " trace events to " << file_);
+    if (dropped > 0) {
+        CLI_LOG_WARN("Dropped " << dropped << " trace events, per thread limit reached");
+    }
+    return ofs.good();
+}
+
+TraceSpan::TraceSpan(const char* name, const char* category, const std::string& detail)
+    : name_(name), category_(category) {
+    if (Trace::enabled()) {
+        detail_ = detail;
+        start_ = Trace::Clock::now();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (Trace::enabled() && start_ != Trace::Clock::time_point()) {
+        Trace::span(name_, category_, start_, Trace::Clock::now(), detail_);
+    }
+}
+
+} // namespace
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+
+namespace nabtocli {
+
+/**
+ * Opt-in recording of timed spans in Chrome trace event format, for
+ * viewing in chrome://tracing or Perfetto. Each thread appends to its
+ * own buffer; the buffers are merged and written to the trace file at
+ * exit.
+ */
+class Trace {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // record from now on and write file at exit
+    static void enable(const std::string& file);
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+    // name and category must be string literals or otherwise outlive the
+    // trace, track 0 is the calling thread
+    static void span(const char* name, const char* category, Clock::time_point start, Clock::time_point end,
+                     const std::string& detail = "", int track = 0);
+    // name a track other than a thread, e.g. one per tunnel
+    static void nameTrack(int track, const std::string& name);
+    static bool write();
+private:
+    static std::atomic<bool> enabled_;
+};
+
+/**
+ * Records the time from construction to destruction as a span, if
+ * tracing is enabled.
+ */
+class TraceSpan {
+private:
+    const char* name_;
+    const char* category_;
+    std::string detail_;
+    Trace::Clock::time_point start_;
+public:
+    TraceSpan(const char* name, const char* category, const std::string& detail = "");
+    ~TraceSpan();
+};
+
+} // namespace
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "tunnel_bench.hpp"
+#include "output.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+
+namespace nabtocli {
+
+#ifndef WIN32
+
+// a stalled tunnel counts as an error instead of hanging the client
+static const int SOCKET_TIMEOUT_SECONDS = 5;
+static const std::chrono::milliseconds RECONNECT_DELAY(100);
+// bounds how far a stream mode client can run past the deadline
+static const int STREAM_POLL_MS = 100;
+
+static bool writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::read(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * One step of bulk transfer. Data coming back, e.g. from an echo
+ * service, is read and discarded, such that neither end blocks on a
+ * full receive buffer.
+ */
+static bool streamStep(int fd, const char* out, size_t outLen, char* in, size_t inLen,
+                       uint64_t& sent, uint64_t& received) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN | POLLOUT;
+    p.revents = 0;
+    int r = poll(&p, 1, STREAM_POLL_MS);
+    if (r <= 0) {
+        return r == 0 || errno == EINTR;
+    }
+    if (p.revents & POLLIN) {
+        ssize_t n = recv(fd, in, inLen, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            return false;
+        }
+        if (n > 0) {
+            received += n;
+        }
+    }
+    if (p.revents & POLLOUT) {
+        ssize_t n = send(fd, out, outLen, MSG_DONTWAIT);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return false;
+        }
+        if (n > 0) {
+            sent += n;
+        }
+    }
+    return !(p.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+static uint64_t micros(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+TunnelBench::TunnelBench(uint16_t port, Mode mode, size_t connections, size_t payload, std::chrono::seconds duration)
+    : port_(port), mode_(mode), connections_(connections), payload_(payload), duration_(duration) {
+}
+
+void TunnelBench::stop() {
+    stop_ = true;
+}
+
+int TunnelBench::connectLocal() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv;
+    tv.tv_sec = SOCKET_TIMEOUT_SECONDS;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+void TunnelBench::client(Stats& stats) {
+    std::vector<char> out(payload_), in(payload_);
+    for (size_t i = 0; i < payload_; i++) {
+        out[i] = (char)('a' + i % 26);
+    }
+    int fd = -1;
+    while (!stop_ && Clock::now() < deadline_) {
+        if (fd < 0) {
+            Clock::time_point start = Clock::now();
+            fd = connectLocal();
+            if (fd < 0) {
+                stats.errors++;
+                std::this_thread::sleep_for(RECONNECT_DELAY);
+                continue;
+            }
+            stats.connectLatency.record(micros(Clock::now() - start));
+            stats.connects++;
+        }
+        bool ok;
+        if (mode_ == RR) {
+            Clock::time_point start = Clock::now();
+            ok = writeAll(fd, out.data(), payload_) && readAll(fd, in.data(), payload_);
+            if (ok) {
+                stats.latency.record(micros(Clock::now() - start));
+                stats.requests++;
+                stats.bytesSent += payload_;
+                stats.bytesReceived += payload_;
+            }
+        } else {
+            ok = streamStep(fd, out.data(), payload_, in.data(), payload_, stats.bytesSent, stats.bytesReceived);
+        }
+        if (!ok) {
+            stats.errors++;
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+void TunnelBench::run() {
+    std::vector<Stats> stats(connections_);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    deadline_ = start + duration_;
+    for (size_t i = 0; i < connections_; i++) {
+        threads.push_back(std::thread(&TunnelBench::client, this, std::ref(stats[i])));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    elapsed_ = Clock::now() - start;
+    for (auto& s : stats) {
+        total_.connectLatency.merge(s.connectLatency);
+        total_.latency.merge(s.latency);
+        total_.connects += s.connects;
+        total_.errors += s.errors;
+        total_.requests += s.requests;
+        total_.bytesSent += s.bytesSent;
+        total_.bytesReceived += s.bytesReceived;
+    }
+}
+
+void TunnelBench::printResults(const char* connectionType) {
+    double seconds = std::chrono::duration<double>(elapsed_).count();
+    uint64_t bytes = total_.bytesSent + total_.bytesReceived;
+    double goodput = seconds > 0 ? bytes * 8 / seconds / 1e6 : 0;
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("tunnel_bench");
+        event["connection"] = connectionType;
+        event["mode"] = mode_ == RR ? "rr" : "stream";
+        event["connections"] = (Json::UInt64)connections_;
+        event["payload"] = (Json::UInt64)payload_;
+        event["duration_s"] = seconds;
+        event["bytes_sent"] = (Json::UInt64)total_.bytesSent;
+        event["bytes_received"] = (Json::UInt64)total_.bytesReceived;
+        event["goodput_mbps"] = goodput;
+        event["connects"] = (Json::UInt64)total_.connects;
+        event["errors"] = (Json::UInt64)total_.errors;
+        event["connect_latency"] = total_.connectLatency.toJson("us");
+        if (mode_ == RR) {
+            event["requests"] = (Json::UInt64)total_.requests;
+            event["requests_per_s"] = seconds > 0 ? total_.requests / seconds : 0;
+            event["latency"] = total_.latency.toJson("us");
+        }
+        Output::emit(event);
+        return;
+    }
+    std::ostream& out = Output::results();
+    out << std::fixed << std::setprecision(2)
+        << "Tunnel bench over " << connectionType << ", " << (mode_ == RR ? "RR" : "STREAM") << " mode, "
+        << connections_ << " connection(s), " << payload_ << " byte payload, " << seconds << " s" << std::endl
+        << "  goodput " << goodput << " Mbit/s (" << total_.bytesSent << " bytes sent, "
+        << total_.bytesReceived << " bytes received)" << std::endl
+        << "  " << total_.connects << " connects, " << total_.errors << " errors, connect latency p50 "
+        << total_.connectLatency.percentile(50) / 1000.0 << " ms, p99 "
+        << total_.connectLatency.percentile(99) / 1000.0 << " ms" << std::endl;
+    if (mode_ == RR) {
+        out << "  " << total_.requests << " requests (" << (seconds > 0 ? total_.requests / seconds : 0)
+            << "/s), latency p50 " << total_.latency.percentile(50) / 1000.0
+            << " ms, p90 " << total_.latency.percentile(90) / 1000.0
+            << " ms, p99 " << total_.latency.percentile(99) / 1000.0
+            << " ms, p99.9 " << total_.latency.percentile(99.9) / 1000.0
+            << " ms, max " << total_.latency.max() / 1000.0 << " ms" << std::endl;
+    }
+    out << std::defaultfloat << std::setprecision(6);
+}
+
+#endif
+
+} // namespace
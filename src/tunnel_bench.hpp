@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "histogram.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+
+
+namespace nabtocli {
+
+#ifndef WIN32
+/**
+ * TCP load generator for the local end of a tunnel. Each connection
+ * runs on its own thread, either request/response (RR), writing a
+ * payload and waiting for it to be echoed back, or bulk (STREAM),
+ * writing payloads as fast as the tunnel accepts them and discarding
+ * anything sent back. Connections are kept open and reconnected on
+ * errors. Goodput counts application bytes in both directions.
+ */
+class TunnelBench {
+public:
+    enum Mode { RR, STREAM };
+
+    TunnelBench(uint16_t port, Mode mode, size_t connections, size_t payload, std::chrono::seconds duration);
+    void run();
+    // thread safe, ends run early
+    void stop();
+    void printResults(const char* connectionType);
+
+private:
+    struct Stats {
+        Histogram connectLatency;
+        Histogram latency;
+        uint64_t connects = 0;
+        uint64_t errors = 0;
+        uint64_t requests = 0;
+        uint64_t bytesSent = 0;
+        uint64_t bytesReceived = 0;
+    };
+    typedef std::chrono::steady_clock Clock;
+
+    void client(Stats& stats);
+    int connectLocal();
+
+    uint16_t port_;
+    Mode mode_;
+    size_t connections_;
+    size_t payload_;
+    std::chrono::seconds duration_;
+    Clock::duration elapsed_ { 0 };
+    Clock::time_point deadline_;
+    Stats total_;
+    std::atomic<bool> stop_ { false };
+};
+#endif
+
+} // namespace
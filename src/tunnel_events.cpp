@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#include "tunnel_events.hpp"
+#include "output.hpp"
+
+#include <chrono>
+#include <memory>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+
+namespace nabtocli {
+
+const char* tunnelStateStr(nabto_tunnel_state_t state) {
+    switch(state)
+    {
+    case NTCS_CLOSED: return "CLOSED";
+    case NTCS_CONNECTING: return "CONNECTING";
+    case NTCS_READY_FOR_RECONNECT: return "READY_FOR_RECONNECT";
+    case NTCS_UNKNOWN: return "Unknown connection";
+    case NTCS_LOCAL: return "LOCAL";
+    case NTCS_REMOTE_P2P: return "REMOTE_P2P";
+    case NTCS_REMOTE_RELAY: return "REMOTE_RELAY (UDP)";
+    case NTCS_REMOTE_RELAY_MICRO: return "REMOTE_RELAY (TCP)";
+    default: return "?";
+    }
+}
+
+Json::Value tunnelEventToJson(const TunnelEvent& event) {
+    Json::Value doc;
+    doc["event"] = "tunnel_state";
+    doc["ts"] = (Json::Int64)event.timestamp;
+    doc["tunnel"] = Output::handle(event.tunnel);
+    doc["device"] = event.deviceId;
+    doc["state"] = tunnelStateStr(event.state);
+    doc["state_code"] = event.state;
+    doc["previous_state"] = tunnelStateStr(event.previousState);
+    doc["previous_state_code"] = event.previousState;
+    if (event.hasLastError) {
+        doc["last_error"] = event.lastError;
+    }
+    if (event.port >= 0) {
+        doc["port"] = event.port;
+    }
+    return doc;
+}
+
+TunnelEventPublisher::TunnelEventPublisher(Callback callback, size_t capacity)
+    : callback_(callback), queue_(capacity) {
+    thread_ = std::thread(&TunnelEventPublisher::dispatch, this);
+}
+
+TunnelEventPublisher::~TunnelEventPublisher() {
+    stop_ = true;
+    thread_.join();
+}
+
+void TunnelEventPublisher::publish(const TunnelEvent& event) {
+    if (!queue_.push(event)) {
+        dropped_++;
+    }
+}
+
+void TunnelEventPublisher::dispatch() {
+    TunnelEvent event;
+    while (true) {
+        if (queue_.pop(event)) {
+            callback_(event);
+        } else if (stop_) {
+            // queue drained after stop
+            return;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+#ifndef WIN32
+TunnelEventPublisher::Callback tunnelEventFdSink(int fd) {
+    // only used from the dispatch thread
+    std::shared_ptr<NdjsonSerializer> serializer(new NdjsonSerializer());
+    return [fd, serializer](const TunnelEvent& event) {
+        const std::string& line = serializer->serialize(tunnelEventToJson(event));
+        size_t written = 0;
+        while (written < line.size()) {
+            ssize_t n = ::write(fd, line.data() + written, line.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                return;
+            }
+            written += n;
+        }
+    };
+}
+
+int tunnelEventSocketConnect(const std::string& path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+} // namespace
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+#include "nabto_client_api.h"
+#include "spsc_queue.hpp"
+
+#include <json/json.h>
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <cstdint>
+#include <functional>
+
+
+namespace nabtocli {
+
+struct TunnelEvent {
+    int64_t timestamp; // unix time in ms
+    nabto_tunnel_t tunnel;
+    std::string deviceId;
+    nabto_tunnel_state_t previousState;
+    nabto_tunnel_state_t state;
+    bool hasLastError;
+    int lastError;
+    int port;
+};
+
+const char* tunnelStateStr(nabto_tunnel_state_t state);
+Json::Value tunnelEventToJson(const TunnelEvent& event);
+
+/**
+ * Hands tunnel events from the polling thread to a callback running on
+ * a separate dispatch thread. If the callback cannot keep up, events
+ * are dropped and counted instead of blocking the publisher.
+ */
+class TunnelEventPublisher {
+public:
+    typedef std::function<void(const TunnelEvent& event)> Callback;
+    TunnelEventPublisher(Callback callback, size_t capacity = 1024);
+    ~TunnelEventPublisher();
+    // must only be called from one thread
+    void publish(const TunnelEvent& event);
+    uint64_t dropped() const { return dropped_; }
+private:
+    void dispatch();
+    Callback callback_;
+    SpscQueue<TunnelEvent> queue_;
+    std::atomic<uint64_t> dropped_ { 0 };
+    std::atomic<bool> stop_ { false };
+    std::thread thread_;
+};
+
+#ifndef WIN32
+/**
+ * Callback writing events as NDJSON lines to a file descriptor, e.g.
+ * a pipe inherited from a supervisor.
+ */
+TunnelEventPublisher::Callback tunnelEventFdSink(int fd);
+// connect to a unix domain socket, returns -1 on failure
+int tunnelEventSocketConnect(const std::string& path);
+#endif
+
+} // namespace
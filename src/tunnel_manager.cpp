@@ -3,109 +3,494 @@
  */
 
 #include "tunnel_manager.hpp"
+#include "output.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "flight_recorder.hpp"
 
 #include <thread>
+#include <chrono>
 #include <map>
 #include <string>
-#include <iostream>
+#include <fstream>
+#include <sstream>
 
 
 namespace nabtocli {
 
+// give up on an upgrade attempt if the candidate tunnel is not connected by then
+static const std::chrono::seconds UPGRADE_PROBE_TIMEOUT(15);
+// trace tracks of tunnel states, offset from thread ids
+static const int TUNNEL_TRACK_BASE = 100000;
+
+bool TunnelManager::isConnected(nabto_tunnel_state_t state) {
+    return state == NTCS_LOCAL ||
+        state == NTCS_REMOTE_P2P ||
+        state == NTCS_REMOTE_RELAY ||
+        state == NTCS_REMOTE_RELAY_MICRO;
+}
+
+/**
+ * Number of established TCP connections accepted on the local port,
+ * or -1 if it cannot be determined on this platform.
+ */
+static int localTcpConnections(uint16_t port) {
+#ifdef __linux__
+    int count = 0;
+    bool found = false;
+    const char* files[] = { "/proc/net/tcp", "/proc/net/tcp6" };
+    for (auto file : files) {
+        std::ifstream ifs(file);
+        if (!ifs.good()) {
+            continue;
+        }
+        found = true;
+        std::string line;
+        std::getline(ifs, line); // header
+        while (std::getline(ifs, line)) {
+            // sl local_address rem_address st ...
+            std::istringstream ls(line);
+            std::string sl, local, remote, state;
+            ls >> sl >> local >> remote >> state;
+            size_t colon = local.rfind(':');
+            if (colon == std::string::npos || state != "01") {
+                continue;
+            }
+            if (std::stoul(local.substr(colon + 1), 0, 16) == port) {
+                count++;
+            }
+        }
+    }
+    return found ? count : -1;
+#else
+    return -1;
+#endif
+}
+
 TunnelManager::TunnelManager(nabto_handle_t session)
     : session_(session) {
 }
 
+void TunnelManager::setUpgradeInterval(std::chrono::seconds interval) {
+    upgradeInterval_ = interval;
+}
+
+void TunnelManager::setEventCallback(TunnelEventPublisher::Callback callback) {
+    events_.reset(new TunnelEventPublisher(callback));
+}
+
 bool TunnelManager::open(uint16_t localPort,
                          const std::string& deviceId,
                          const std::string& remoteHost,
-                         uint16_t remotePort) {
+                         uint16_t remotePort,
+                         int* id) {
+    TraceSpan span("tunnel_open", "tunnel", deviceId);
     nabto_tunnel_t tunnel;
     nabto_status_t st = nabtoTunnelOpenTcp(&tunnel, session_, localPort, deviceId.c_str(), remoteHost.c_str(), remotePort);
     if (st == NABTO_OK) {
+        std::lock_guard<std::mutex> lock(mutex_);
         tunnels_.push_back(tunnel);
         tunnelStates_[tunnel] = NTCS_UNKNOWN;
+        TunnelInfo& info = tunnelInfo_[tunnel];
+        info.id = nextId_++;
+        Trace::nameTrack(TUNNEL_TRACK_BASE + info.id, "tunnel " + std::to_string(info.id) + " " + deviceId);
+        if (id) {
+            *id = info.id;
+        }
+        info.deviceId = deviceId;
+        info.remoteHost = remoteHost;
+        info.remotePort = remotePort;
+        info.localPort = localPort;
+        info.stateSince = Clock::now();
+        info.lastUpgradeAttempt = info.stateSince;
+        info.probe = 0;
         return true;
     } else {
-        std::cout << "Could not open tunnel to " << deviceId << ", tunnel open failed with status " << st << std::endl;
+        FlightRecorder::record(FlightRecorder::EVENT_ERROR, st, 0, deviceId.c_str(), nabtoStatusStr(st));
+        CLI_LOG_ERROR("Could not open tunnel to " << deviceId << ", tunnel open failed with status " << st);
         return false;
     }
 }
     
-bool TunnelManager::watchStatus() {
+bool TunnelManager::close(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = tunnels_.begin(); it != tunnels_.end(); ++it) {
+        nabto_tunnel_t tunnel = *it;
+        TunnelInfo& info = tunnelInfo_[tunnel];
+        if (info.id != id) {
+            continue;
+        }
+        if (info.probe) {
+            nabtoTunnelClose(info.probe);
+        }
+        trackState(info, tunnelStates_[tunnel]);
+        nabto_status_t st = nabtoTunnelClose(tunnel);
+        tunnels_.erase(it);
+        tunnelInfo_.erase(tunnel);
+        tunnelStates_.erase(tunnel);
+        return st == NABTO_OK;
+    }
+    return false;
+}
+
+std::vector<TunnelManager::TunnelStatus> TunnelManager::list() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<TunnelStatus> result;
+    for (auto&& tunnel : tunnels_) {
+        TunnelInfo& info = tunnelInfo_[tunnel];
+        TunnelStatus status;
+        status.id = info.id;
+        status.deviceId = info.deviceId;
+        status.remoteHost = info.remoteHost;
+        status.remotePort = info.remotePort;
+        status.localPort = info.localPort;
+        status.state = tunnelStates_[tunnel];
+        result.push_back(status);
+    }
+    return result;
+}
+
+nabto_tunnel_state_t TunnelManager::waitConnected(int id, std::chrono::milliseconds timeout) {
+    Clock::time_point deadline = Clock::now() + timeout;
+    nabto_tunnel_state_t state = NTCS_UNKNOWN;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nabto_tunnel_t tunnel = 0;
+            for (auto&& t : tunnels_) {
+                if (tunnelInfo_[t].id == id) {
+                    tunnel = t;
+                    break;
+                }
+            }
+            if (!tunnel || nabtoTunnelInfo(tunnel, NTI_STATUS, sizeof(state), &state) != NABTO_OK) {
+                return NTCS_CLOSED;
+            }
+            unsigned short port;
+            if (isConnected(state) && nabtoTunnelInfo(tunnel, NTI_PORT, sizeof(port), &port) == NABTO_OK) {
+                tunnelInfo_[tunnel].localPort = port;
+            }
+        }
+        if (isConnected(state) || state == NTCS_CLOSED || Clock::now() >= deadline) {
+            return state;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+bool TunnelManager::watchStatus(bool untilAllClosed) {
     bool allClosed = false;
-    while (!stop_ && !allClosed) {
+    while (!stop_ && !(untilAllClosed && allClosed)) {
         allClosed = true;
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        for (auto&& tunnel : tunnels_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (draining_ && drained()) {
+            break;
+        }
+        for (auto it = tunnels_.begin(); it != tunnels_.end(); ) {
+            nabto_tunnel_t& tunnel = *it;
+            if (upgradeInterval_.count() > 0 && !checkUpgrade(tunnel)) {
+                dropReleased(tunnel);
+                it = tunnels_.erase(it);
+                continue;
+            }
             nabto_tunnel_state_t newState = NTCS_CLOSED;
+            bool hasLastError = false;
+            int lastError = 0;
             nabto_status_t st = nabtoTunnelInfo(tunnel, NTI_STATUS, sizeof(newState), &newState);
             if (st != NABTO_OK) {
-                std::cout << "Failed to get tunnel status for tunnel " << tunnel << std::endl;
+                CLI_LOG_ERROR("Failed to get tunnel status for tunnel " << tunnel);
             } else if (newState == NTCS_CLOSED && tunnelStates_[tunnel] != NTCS_CLOSED) {
                 int ec;
                 st = nabtoTunnelInfo(tunnel, NTI_LAST_ERROR, sizeof(ec), &ec);
-                if (st == NABTO_OK) {
-                    std::cout << "Connection closed, last error = " << ec << std::endl;
+                hasLastError = st == NABTO_OK;
+                lastError = ec;
+                FlightRecorder::record(FlightRecorder::EVENT_TUNNEL_CLOSED, hasLastError ? ec : -1, tunnelInfo_[tunnel].id, tunnelInfo_[tunnel].deviceId.c_str());
+                if (Output::ndjson()) {
+                    Json::Value event = Output::event("tunnel_closed");
+                    event["tunnel"] = Output::handle(tunnel);
+                    if (st == NABTO_OK) {
+                        event["last_error"] = ec;
+                    }
+                    Output::emit(event);
+                } else if (st == NABTO_OK) {
+                    CLI_LOG_INFO("Connection closed, last error = " << ec);
                 } else {
-                    std::cout << "Connection closed, could not get error code" << std::endl;
+                    CLI_LOG_INFO("Connection closed, could not get error code");
                 }
             } else {
                 allClosed = false;
             }
                 
             if (tunnelStates_[tunnel] != newState) {
-                std::cout << "State has changed for tunnel " << tunnel << " status " << statusStr(newState) << " (" << newState << ")" << std::endl;
+                int port = -1;
+                if (Output::ndjson()) {
+                    Json::Value event = Output::event("tunnel_state");
+                    event["tunnel"] = Output::handle(tunnel);
+                    event["state"] = statusStr(newState);
+                    event["state_code"] = newState;
+                    Output::emit(event);
+                } else {
+                    CLI_LOG_INFO("State has changed for tunnel " << tunnel << " status " << statusStr(newState) << " (" << newState << ")");
+                }
+                nabto_tunnel_state_t previousState = tunnelStates_[tunnel];
+                FlightRecorder::record(FlightRecorder::EVENT_TUNNEL_STATE, newState, tunnelInfo_[tunnel].id, tunnelInfo_[tunnel].deviceId.c_str(), statusStr(newState));
                 tunnelStates_[tunnel] = newState;
+                trackState(tunnelInfo_[tunnel], previousState);
                 int version;
-                if (newState == NTCS_LOCAL ||
-                    newState == NTCS_REMOTE_P2P ||
-                    newState == NTCS_REMOTE_RELAY ||
-                    newState == NTCS_REMOTE_RELAY_MICRO)
-                {
+                if (isConnected(newState)) {
                     version = -1; 
                     nabtoTunnelInfo(tunnel, NTI_VERSION, sizeof(version), &version);
-                    unsigned short port = -1;
-                    nabtoTunnelInfo(tunnel, NTI_PORT, sizeof(port), &port);
-                    std::cout << "Tunnel " << tunnel << " connected, tunnel version: " << version << ", local TCP port: " << port << std::endl;
+                    unsigned short localPort = -1;
+                    nabtoTunnelInfo(tunnel, NTI_PORT, sizeof(localPort), &localPort);
+                    port = localPort;
+                    tunnelInfo_[tunnel].localPort = localPort;
+                    if (Output::ndjson()) {
+                        Json::Value event = Output::event("tunnel_connected");
+                        event["tunnel"] = Output::handle(tunnel);
+                        event["version"] = version;
+                        event["port"] = port;
+                        event["connection"] = statusStr(newState);
+                        Output::emit(event);
+                    } else {
+                        CLI_LOG_INFO("Tunnel " << tunnel << " connected, tunnel version: " << version << ", local TCP port: " << port);
+                    }
+                }
+                if (events_) {
+                    TunnelEvent event;
+                    event.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+                    event.tunnel = tunnel;
+                    event.deviceId = tunnelInfo_[tunnel].deviceId;
+                    event.previousState = previousState;
+                    event.state = newState;
+                    event.hasLastError = hasLastError;
+                    event.lastError = lastError;
+                    event.port = port;
+                    events_->publish(event);
                 }
             }
+            ++it;
+        }
+    }
+    printStats();
+    return true;
+}
+
+void TunnelManager::trackState(TunnelInfo& info, nabto_tunnel_state_t oldState) {
+    Clock::time_point now = Clock::now();
+    Trace::span(statusStr(oldState), "tunnel_state", info.stateSince, now, info.deviceId, TUNNEL_TRACK_BASE + info.id);
+    info.timeInState[oldState] += now - info.stateSince;
+    info.stateSince = now;
+}
+
+/**
+ * A relayed tunnel with no client connections is periodically
+ * challenged by a candidate tunnel to the same device. If the candidate
+ * gets a P2P or local connection, the relayed tunnel is closed and
+ * reopened on the same local port, such that it picks up the better
+ * connection. The SDK owns the listening socket, so the port cannot be
+ * handed over; the reopen happens right after the close in the same
+ * watcher iteration while no clients are connected.
+ */
+bool TunnelManager::checkUpgrade(nabto_tunnel_t& tunnel) {
+    TunnelInfo& info = tunnelInfo_[tunnel];
+    nabto_tunnel_state_t state = tunnelStates_[tunnel];
+    Clock::time_point now = Clock::now();
+
+    if (info.probe) {
+        nabto_tunnel_state_t probeState = NTCS_CLOSED;
+        if (nabtoTunnelInfo(info.probe, NTI_STATUS, sizeof(probeState), &probeState) != NABTO_OK) {
+            probeState = NTCS_CLOSED;
+        }
+        bool better = probeState == NTCS_LOCAL || probeState == NTCS_REMOTE_P2P;
+        bool failed = probeState == NTCS_CLOSED ||
+            probeState == NTCS_REMOTE_RELAY ||
+            probeState == NTCS_REMOTE_RELAY_MICRO ||
+            now - info.probeStarted > UPGRADE_PROBE_TIMEOUT;
+        if (!better && !failed) {
+            return true;
+        }
+        nabtoTunnelClose(info.probe);
+        info.probe = 0;
+        if (!better || localTcpConnections(info.localPort) != 0) {
+            return true;
+        }
+
+        nabto_tunnel_t upgraded;
+        nabtoTunnelClose(tunnel);
+        nabto_status_t st = nabtoTunnelOpenTcp(&upgraded, session_, info.localPort, info.deviceId.c_str(), info.remoteHost.c_str(), info.remotePort);
+        if (st != NABTO_OK) {
+            CLI_LOG_ERROR("Could not reopen tunnel " << tunnel << " on port " << info.localPort << " for upgrade, status " << st);
+            // the old handle is already closed, the caller drops it
+            return false;
         }
+        CLI_LOG_INFO("Upgrading tunnel " << tunnel << " on port " << info.localPort << " from " << statusStr(state) << " to " << statusStr(probeState) << ", new tunnel " << upgraded);
+        upgradeSuccesses_++;
+        trackState(info, state);
+        tunnelInfo_[upgraded] = info;
+        tunnelStates_[upgraded] = NTCS_UNKNOWN;
+        tunnelInfo_.erase(tunnel);
+        tunnelStates_.erase(tunnel);
+        tunnel = upgraded;
+        return true;
+    }
+
+    if ((state != NTCS_REMOTE_RELAY && state != NTCS_REMOTE_RELAY_MICRO) ||
+        now - info.lastUpgradeAttempt < upgradeInterval_) {
+        return true;
+    }
+    info.lastUpgradeAttempt = now;
+    if (localTcpConnections(info.localPort) != 0) {
+        // in use or unknown, never disturb active clients
+        return true;
     }
+    upgradeAttempts_++;
+    if (nabtoTunnelOpenTcp(&info.probe, session_, 0, info.deviceId.c_str(), info.remoteHost.c_str(), info.remotePort) != NABTO_OK) {
+        info.probe = 0;
+        return true;
+    }
+    info.probeStarted = now;
     return true;
 }
 
+/**
+ * Reports a tunnel whose handle was closed by a failed upgrade as closed
+ * and forgets it, such that it is neither polled nor closed again.
+ */
+void TunnelManager::dropReleased(nabto_tunnel_t tunnel) {
+    TunnelInfo& info = tunnelInfo_[tunnel];
+    nabto_tunnel_state_t previousState = tunnelStates_[tunnel];
+    FlightRecorder::record(FlightRecorder::EVENT_TUNNEL_CLOSED, -1, info.id, info.deviceId.c_str());
+    FlightRecorder::record(FlightRecorder::EVENT_TUNNEL_STATE, NTCS_CLOSED, info.id, info.deviceId.c_str(), statusStr(NTCS_CLOSED));
+    if (Output::ndjson()) {
+        Json::Value event = Output::event("tunnel_closed");
+        event["tunnel"] = Output::handle(tunnel);
+        Output::emit(event);
+        event = Output::event("tunnel_state");
+        event["tunnel"] = Output::handle(tunnel);
+        event["state"] = statusStr(NTCS_CLOSED);
+        event["state_code"] = NTCS_CLOSED;
+        Output::emit(event);
+    } else {
+        CLI_LOG_INFO("Connection closed, could not get error code");
+        CLI_LOG_INFO("State has changed for tunnel " << tunnel << " status " << statusStr(NTCS_CLOSED) << " (" << NTCS_CLOSED << ")");
+    }
+    trackState(info, previousState);
+    if (events_) {
+        TunnelEvent event;
+        event.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        event.tunnel = tunnel;
+        event.deviceId = info.deviceId;
+        event.previousState = previousState;
+        event.state = NTCS_CLOSED;
+        event.hasLastError = false;
+        event.lastError = 0;
+        event.port = -1;
+        events_->publish(event);
+    }
+    tunnelInfo_.erase(tunnel);
+    tunnelStates_.erase(tunnel);
+}
+
+void TunnelManager::printStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point now = Clock::now();
+    for (auto&& tunnel : tunnels_) {
+        TunnelInfo& info = tunnelInfo_[tunnel];
+        std::map<nabto_tunnel_state_t, Clock::duration> timeInState = info.timeInState;
+        timeInState[tunnelStates_[tunnel]] += now - info.stateSince;
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("tunnel_stats");
+            event["tunnel"] = Output::handle(tunnel);
+            event["device"] = info.deviceId;
+            for (auto&& t : timeInState) {
+                if (isConnected(t.first)) {
+                    event["time_ms"][statusStr(t.first)] = (Json::Int64)std::chrono::duration_cast<std::chrono::milliseconds>(t.second).count();
+                }
+            }
+            Output::emit(event);
+            continue;
+        }
+        std::ostringstream line;
+        line << "Tunnel " << tunnel << " time per connection type:";
+        for (auto&& t : timeInState) {
+            if (isConnected(t.first)) {
+                line << " " << statusStr(t.first) << " " << std::chrono::duration_cast<std::chrono::milliseconds>(t.second).count() << " ms";
+            }
+        }
+        CLI_LOG_INFO(line.str());
+    }
+    if (upgradeInterval_.count() > 0) {
+        if (Output::ndjson()) {
+            Json::Value event = Output::event("tunnel_upgrade_stats");
+            event["attempts"] = (Json::UInt64)upgradeAttempts_;
+            event["successes"] = (Json::UInt64)upgradeSuccesses_;
+            Output::emit(event);
+        } else {
+            CLI_LOG_INFO("Relay to P2P upgrades: " << upgradeAttempts_ << " attempt(s), " << upgradeSuccesses_ << " successful");
+        }
+    }
+}
+
 void TunnelManager::stop() {
     stop_ = true;
 }
 
+void TunnelManager::drain(Clock::time_point deadline) {
+    drainDeadline_ = deadline.time_since_epoch().count();
+    draining_ = true;
+}
+
+/**
+ * The SDK owns the listening sockets, so new client connections cannot
+ * be refused while draining; watching ends when none are open.
+ */
+bool TunnelManager::drained() {
+    int open = 0;
+    for (auto&& tunnel : tunnels_) {
+        int connections = localTcpConnections(tunnelInfo_[tunnel].localPort);
+        if (connections > 0) {
+            open += connections;
+        }
+    }
+    if (open == 0) {
+        CLI_LOG_INFO("All tunnel connections drained");
+        return true;
+    }
+    if (Clock::now().time_since_epoch().count() >= drainDeadline_) {
+        CLI_LOG_WARN("Drain deadline reached with " << open << " tunnel connection(s) open");
+        return true;
+    }
+    return false;
+}
+
 bool TunnelManager::close() {
-    std::cout << "Closing " << tunnels_.size() << " tunnel(s)" << std::endl;
+    std::lock_guard<std::mutex> lock(mutex_);
+    CLI_LOG_INFO("Closing " << tunnels_.size() << " tunnel(s)");
     for (auto&& tunnel : tunnels_) {
+        if (tunnelInfo_[tunnel].probe) {
+            nabtoTunnelClose(tunnelInfo_[tunnel].probe);
+            tunnelInfo_[tunnel].probe = 0;
+        }
+        trackState(tunnelInfo_[tunnel], tunnelStates_[tunnel]);
         nabto_status_t st = nabtoTunnelClose(tunnel);
         if (st == NABTO_OK) {
-            std::cout << "Tunnel " << tunnel << " closed" << std::endl;
+            CLI_LOG_INFO("Tunnel " << tunnel << " closed");
         } else {
-            std::cout << "Tunnel " << tunnel << " close failed with status " << st << std::endl;
+            CLI_LOG_ERROR("Tunnel " << tunnel << " close failed with status " << st);
         }
     }
+    if (events_ && events_->dropped() > 0) {
+        CLI_LOG_WARN("Dropped " << events_->dropped() << " tunnel event(s), consumer too slow");
+    }
     return true;
 }
 
 const char* TunnelManager::statusStr(nabto_tunnel_state_t status) {
-    switch(status)
-    {
-    case NTCS_CLOSED: return "CLOSED";
-    case NTCS_CONNECTING: return "CONNECTING";
-    case NTCS_READY_FOR_RECONNECT: return "READY_FOR_RECONNECT";
-    case NTCS_UNKNOWN: return "Unknown connection";
-    case NTCS_LOCAL: return "LOCAL";
-    case NTCS_REMOTE_P2P: return "REMOTE_P2P";
-    case NTCS_REMOTE_RELAY: return "REMOTE_RELAY (UDP)";
-    case NTCS_REMOTE_RELAY_MICRO: return "REMOTE_RELAY (TCP)";
-    default: return "?";
-    }
-};
+    return tunnelStateStr(status);
+}
 
 
 } // namespace
@@ -4,31 +4,90 @@
 
 #pragma once
 #include "nabto_client_api.h"
+#include "tunnel_events.hpp"
 
 #include <vector>
 #include <map>
 #include <atomic>
 #include <string>
+#include <memory>
+#include <chrono>
+#include <mutex>
 
 
 namespace nabtocli {
 
 class TunnelManager {
+public:
+    struct TunnelStatus {
+        int id;
+        std::string deviceId;
+        std::string remoteHost;
+        uint16_t remotePort;
+        uint16_t localPort;
+        nabto_tunnel_state_t state;
+    };
 private:
+    typedef std::chrono::steady_clock Clock;
+    struct TunnelInfo {
+        // stable across relay to P2P upgrades which replace the tunnel handle
+        int id;
+        std::string deviceId;
+        std::string remoteHost;
+        uint16_t remotePort;
+        uint16_t localPort;
+        Clock::time_point stateSince;
+        std::map<nabto_tunnel_state_t, Clock::duration> timeInState;
+        Clock::time_point lastUpgradeAttempt;
+        // candidate tunnel of a relay to P2P upgrade attempt, if any
+        nabto_tunnel_t probe;
+        Clock::time_point probeStarted;
+    };
     std::vector<nabto_tunnel_t> tunnels_;
     std::map<nabto_tunnel_t, nabto_tunnel_state_t> tunnelStates_;
+    std::map<nabto_tunnel_t, TunnelInfo> tunnelInfo_;
+    // guards the tunnel containers, which the watcher and e.g. shell commands share
+    std::mutex mutex_;
+    int nextId_ = 1;
     nabto_handle_t session_;
     std::atomic<bool> stop_ { false };
+    std::atomic<bool> draining_ { false };
+    std::atomic<Clock::rep> drainDeadline_ { 0 };
+    std::unique_ptr<TunnelEventPublisher> events_;
+    std::chrono::seconds upgradeInterval_ { 0 };
+    size_t upgradeAttempts_ = 0;
+    size_t upgradeSuccesses_ = 0;
     const char* statusStr(nabto_tunnel_state_t status);
+    void trackState(TunnelInfo& info, nabto_tunnel_state_t oldState);
+    // false if the tunnel was closed for an upgrade and could not be reopened
+    bool checkUpgrade(nabto_tunnel_t& tunnel);
+    void dropReleased(nabto_tunnel_t tunnel);
+    bool drained();
 public:
     TunnelManager(nabto_handle_t session);
+    // true for the states of an established tunnel, whatever the connection type
+    static bool isConnected(nabto_tunnel_state_t state);
+    // deliver state transitions to callback on a separate thread, call before watchStatus
+    void setEventCallback(TunnelEventPublisher::Callback callback);
     bool open(uint16_t localPort,
               const std::string& deviceId,
               const std::string& remoteHost,
-              uint16_t remotePort);
+              uint16_t remotePort,
+              int* id = 0);
+    bool close(int id);
+    std::vector<TunnelStatus> list();
+    // poll tunnel until connected or closed, returns the last state seen,
+    // list() reports the local port once connected
+    nabto_tunnel_state_t waitConnected(int id, std::chrono::milliseconds timeout);
+    // periodically try to move idle relayed tunnels to P2P, 0 disables
+    void setUpgradeInterval(std::chrono::seconds interval);
     bool close();
-    bool watchStatus();
+    // watch until stopped, and until all tunnels are closed if untilAllClosed
+    bool watchStatus(bool untilAllClosed = true);
     void stop();
+    // stop watching once no client connections are open or at deadline, thread safe
+    void drain(Clock::time_point deadline);
+    void printStats();
 };
 
 } // namespace
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2017 Nabto - All Rights Reserved.
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+namespace nabtocli {
+
+/**
+ * Fixed size pool of threads executing posted tasks in FIFO order.
+ */
+class WorkerPool {
+private:
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()> > tasks_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable idle_;
+    size_t busy_ = 0;
+    bool stop_ = false;
+    void run();
+public:
+    WorkerPool(size_t threads);
+    ~WorkerPool();
+    void post(std::function<void()> task);
+    // block until no tasks are queued or running
+    void wait();
+    size_t size() const { return threads_.size(); }
+};
+
+} // namespace